@@ -0,0 +1,49 @@
+#!/bin/sh
+# replay a scripted session against each font backend and layout under Xvfb,
+# drawing on the server and, with -R, on the client,
+# and report drawmenu() frame times, X requests and text extent queries.
+# usage: bench.sh [items-file]; fonts may be overridden with $BENCHFONTS.
+fonts=${BENCHFONTS:-"fixed
+-*-fixed-medium-r-*-*-13-*-*-*-*-*-*-*,-*-*-medium-r-*-*-13-*-*-*-*-*-*-*
+Monospace-11"}
+tmp=${TMPDIR:-/tmp}/dmenu-bench.$$
+mkdir -p "$tmp" || exit 1
+trap 'kill $xvfb 2>/dev/null; rm -rf "$tmp"' EXIT INT TERM
+
+if [ -n "$1" ]; then
+	cp "$1" "$tmp/items"
+else
+	IFS=:
+	./stest -flx $PATH | sort -u > "$tmp/items"
+	unset IFS
+fi
+
+cat > "$tmp/session" <<!
+type lib
+key BackSpace 3
+type s
+key BackSpace
+key Next 20
+key Prior 20
+key End
+key Home
+key Down 60
+sweep 2
+!
+
+if [ -z "$BENCHDISPLAY" ]; then
+	BENCHDISPLAY=:99
+	Xvfb $BENCHDISPLAY -screen 0 1280x1024x24 -nolisten tcp >/dev/null 2>&1 &
+	xvfb=$!
+	sleep 1
+fi
+export DISPLAY=$BENCHDISPLAY
+
+echo "$fonts" | while read -r fn; do
+	for l in 0 20; do
+		for r in '' -R; do
+			./dmenu-bench $r -fn "$fn" -l $l -S "$tmp/session" < "$tmp/items" ||
+				echo "bench: failed for font '$fn' with -l $l $r" >&2
+		done
+	done
+done
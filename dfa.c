@@ -0,0 +1,416 @@
+/* See LICENSE file for copyright and license details. */
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dfa.h"
+
+#define MAXSTATES 1024 /* cached DFA states; the cache is flushed when full */
+#define INSET(s,c) ((s)[(c) / CHAR_BIT] & (1 << ((c) % CHAR_BIT)))
+
+enum { NEps, NSet, NBol, NEol, NMatch }; /* NFA node types */
+
+typedef struct {
+	int type;
+	int out, out1; /* successors or -1; only NEps uses out1 */
+	unsigned char set[(UCHAR_MAX + 1) / CHAR_BIT]; /* bytes an NSet accepts */
+} Node;
+
+typedef struct {
+	int start, end; /* end is an NEps whose out is not yet set */
+} Frag;
+
+typedef struct {
+	int *set; /* sorted NSet, NEol and NMatch nodes */
+	int n;
+	int bol;       /* made at the beginning of the subject */
+	int accept;    /* a match ends here */
+	int acceptend; /* a match ends here if the subject does */
+	int dead;      /* no match can follow */
+	int next[UCHAR_MAX + 1]; /* transitions, -1 until first taken */
+} State;
+
+struct DFA {
+	Node *nodes;
+	int nnodes, nodesize;
+	int start;          /* NFA start node */
+	State *states;
+	int nstates, s0;    /* s0 is the initial state, -1 if not built */
+	int flushes;
+	int *mark, gen;     /* visit marks for closures */
+	int *stack, *seeds, *buf, *endbuf; /* scratch, one entry per node */
+	const char *p;      /* parse position */
+	int icase, err;
+};
+
+static int addstate(DFA *d, int *set, int n, int bol);
+static void addbyte(DFA *d, int id, int c);
+static int closure(DFA *d, int *seeds, int nseeds, int bol, int eol, int *set);
+static int intcmp(const void *a, const void *b);
+static int node(DFA *d, int type);
+static Frag parsealt(DFA *d);
+static Frag parseatom(DFA *d);
+static Frag parsecat(DFA *d);
+static Frag parserep(DFA *d);
+static Frag single(DFA *d, int type);
+static int step(DFA *d, int st, int c);
+
+int
+addstate(DFA *d, int *set, int n, int bol) {
+	int i, id;
+	State *s;
+
+	for(i = 0; i < d->nstates; i++)
+		if(d->states[i].bol == bol && d->states[i].n == n
+		&& !memcmp(d->states[i].set, set, n * sizeof *set))
+			return i;
+	if(d->nstates == MAXSTATES) {
+		for(i = 0; i < d->nstates; i++)
+			free(d->states[i].set);
+		d->nstates = 0;
+		d->s0 = -1;
+		d->flushes++;
+	}
+	s = &d->states[d->nstates];
+	if(!(s->set = malloc(n * sizeof *set + 1)))
+		return -1;
+	memcpy(s->set, set, n * sizeof *set);
+	s->n = n;
+	s->bol = bol;
+	s->accept = 0;
+	s->dead = 1;
+	for(i = 0; i < n; i++)
+		switch(d->nodes[set[i]].type) {
+		case NMatch:
+			s->accept = 1;
+			break;
+		case NSet:
+		case NEol:
+			s->dead = 0;
+			break;
+		}
+	/* would the subject ending here satisfy a $ on the way to a match? */
+	s->acceptend = s->accept;
+	for(i = closure(d, set, n, bol, 1, d->endbuf); i > 0 && !s->acceptend; i--)
+		if(d->nodes[d->endbuf[i - 1]].type == NMatch)
+			s->acceptend = 1;
+	for(id = 0; id <= UCHAR_MAX; id++)
+		s->next[id] = -1;
+	return d->nstates++;
+}
+
+void
+addbyte(DFA *d, int id, int c) {
+	unsigned char *set = d->nodes[id].set;
+
+	set[c / CHAR_BIT] |= 1 << (c % CHAR_BIT);
+	if(d->icase) {
+		set[tolower(c) / CHAR_BIT] |= 1 << (tolower(c) % CHAR_BIT);
+		set[toupper(c) / CHAR_BIT] |= 1 << (toupper(c) % CHAR_BIT);
+	}
+}
+
+int
+closure(DFA *d, int *seeds, int nseeds, int bol, int eol, int *set) {
+	int i, id, n = 0, sp = 0;
+	Node *nd;
+
+#define PUSH(x) do { if((x) >= 0 && d->mark[(x)] != d->gen) { \
+		d->mark[(x)] = d->gen; d->stack[sp++] = (x); } } while(0)
+	d->gen++;
+	for(i = 0; i < nseeds; i++)
+		PUSH(seeds[i]);
+	/* follow empty transitions; ^ and $ only where they hold */
+	while(sp > 0) {
+		nd = &d->nodes[id = d->stack[--sp]];
+		switch(nd->type) {
+		case NEps:
+			PUSH(nd->out);
+			PUSH(nd->out1);
+			break;
+		case NBol:
+			if(bol)
+				PUSH(nd->out);
+			break;
+		case NEol:
+			if(!eol) {
+				set[n++] = id;
+				break;
+			}
+			PUSH(nd->out);
+			break;
+		default:
+			set[n++] = id;
+			break;
+		}
+	}
+#undef PUSH
+	qsort(set, n, sizeof *set, intcmp);
+	return n;
+}
+
+DFA *
+dfacompile(const char *re, int icase) {
+	DFA *d;
+	Frag f;
+	int m;
+
+	if(!(d = calloc(1, sizeof *d)))
+		return NULL;
+	d->p = re;
+	d->icase = icase;
+	d->s0 = -1;
+	f = parsealt(d);
+	if(*d->p != '\0') /* unbalanced ) */
+		d->err = 1;
+	if(!d->err && (m = node(d, NMatch)) >= 0) {
+		d->nodes[f.end].out = m;
+		d->start = f.start;
+	}
+	if(d->err
+	|| !(d->states = malloc(MAXSTATES * sizeof *d->states))
+	|| !(d->mark = calloc(d->nnodes, sizeof *d->mark))
+	|| !(d->stack = malloc(d->nnodes * sizeof *d->stack))
+	|| !(d->seeds = malloc((d->nnodes + 1) * sizeof *d->seeds))
+	|| !(d->buf = malloc(d->nnodes * sizeof *d->buf))
+	|| !(d->endbuf = malloc(d->nnodes * sizeof *d->endbuf))) {
+		dfafree(d);
+		return NULL;
+	}
+	return d;
+}
+
+void
+dfafree(DFA *d) {
+	int i;
+
+	if(!d)
+		return;
+	for(i = 0; i < d->nstates; i++)
+		free(d->states[i].set);
+	free(d->states);
+	free(d->nodes);
+	free(d->mark);
+	free(d->stack);
+	free(d->seeds);
+	free(d->buf);
+	free(d->endbuf);
+	free(d);
+}
+
+int
+dfamatch(DFA *d, const char *s) {
+	int n, st;
+
+	if(d->s0 < 0) {
+		n = closure(d, &d->start, 1, 1, 0, d->buf);
+		if((d->s0 = addstate(d, d->buf, n, 1)) < 0)
+			return 0;
+	}
+	/* unanchored search: a match may end anywhere */
+	for(st = d->s0; ; s++) {
+		if(d->states[st].accept)
+			return 1;
+		if(d->states[st].dead)
+			return 0;
+		if(!*s)
+			return d->states[st].acceptend;
+		if((n = d->states[st].next[(unsigned char)*s]) < 0
+		&& (n = step(d, st, (unsigned char)*s)) < 0)
+			return 0;
+		st = n;
+	}
+}
+
+int
+intcmp(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+int
+node(DFA *d, int type) {
+	Node *nd;
+
+	if(d->err)
+		return -1;
+	if(d->nnodes == d->nodesize) {
+		if(!(nd = realloc(d->nodes, (d->nodesize + 64) * sizeof *d->nodes))) {
+			d->err = 1;
+			return -1;
+		}
+		d->nodes = nd;
+		d->nodesize += 64;
+	}
+	nd = &d->nodes[d->nnodes];
+	memset(nd, 0, sizeof *nd);
+	nd->type = type;
+	nd->out = nd->out1 = -1;
+	return d->nnodes++;
+}
+
+Frag
+parsealt(DFA *d) {
+	Frag f, g;
+	int s, e;
+
+	f = parsecat(d);
+	while(!d->err && *d->p == '|') {
+		d->p++;
+		g = parsecat(d);
+		s = node(d, NEps);
+		e = node(d, NEps);
+		if(d->err)
+			break;
+		d->nodes[s].out = f.start;
+		d->nodes[s].out1 = g.start;
+		d->nodes[f.end].out = e;
+		d->nodes[g.end].out = e;
+		f.start = s;
+		f.end = e;
+	}
+	return f;
+}
+
+Frag
+parseatom(DFA *d) {
+	Frag f;
+	int c, first, hi, neg;
+
+	switch((c = (unsigned char)*d->p++)) {
+	case '(':
+		f = parsealt(d);
+		if(*d->p == ')')
+			d->p++;
+		else
+			d->err = 1;
+		return f;
+	case '*':
+	case '+':
+	case '?': /* nothing to repeat */
+		d->err = 1;
+		return single(d, NEps);
+	case '^':
+		return single(d, NBol);
+	case '$':
+		return single(d, NEol);
+	case '.':
+		f = single(d, NSet);
+		if(!d->err)
+			memset(d->nodes[f.start].set, 0xff, sizeof d->nodes[f.start].set);
+		return f;
+	case '[':
+		f = single(d, NSet);
+		if((neg = (*d->p == '^')))
+			d->p++;
+		/* a leading ] is literal */
+		for(first = 1; !d->err && *d->p && (*d->p != ']' || first); first = 0) {
+			if((c = (unsigned char)*d->p++) == '\\' && *d->p)
+				c = (unsigned char)*d->p++;
+			hi = c;
+			if(d->p[0] == '-' && d->p[1] && d->p[1] != ']') {
+				hi = (unsigned char)d->p[1];
+				d->p += 2;
+			}
+			for(; c <= hi; c++)
+				addbyte(d, f.start, c);
+		}
+		if(*d->p != ']')
+			d->err = 1;
+		else
+			d->p++;
+		if(!d->err && neg)
+			for(c = 0; c < (int)sizeof d->nodes[f.start].set; c++)
+				d->nodes[f.start].set[c] ^= 0xff;
+		return f;
+	case '\\':
+		if(!*d->p) {
+			d->err = 1;
+			return single(d, NEps);
+		}
+		c = (unsigned char)*d->p++;
+		/* fallthrough */
+	default:
+		f = single(d, NSet);
+		if(!d->err)
+			addbyte(d, f.start, c);
+		return f;
+	}
+}
+
+Frag
+parsecat(DFA *d) {
+	Frag f, g;
+
+	f.start = f.end = node(d, NEps);
+	while(!d->err && *d->p && *d->p != '|' && *d->p != ')') {
+		g = parserep(d);
+		if(d->err)
+			break;
+		d->nodes[f.end].out = g.start;
+		f.end = g.end;
+	}
+	return f;
+}
+
+Frag
+parserep(DFA *d) {
+	Frag f;
+	int s, e;
+
+	f = parseatom(d);
+	while(!d->err && (*d->p == '*' || *d->p == '+' || *d->p == '?')) {
+		s = node(d, NEps);
+		e = node(d, NEps);
+		if(d->err)
+			break;
+		d->nodes[s].out = f.start;
+		d->nodes[s].out1 = e;
+		switch(*d->p++) {
+		case '*': /* s: try f, or skip it; f loops back to s */
+			d->nodes[f.end].out = s;
+			f.start = s;
+			break;
+		case '+': /* f, then s: again, or on */
+			d->nodes[f.end].out = s;
+			break;
+		case '?': /* s: f or skip it */
+			d->nodes[f.end].out = e;
+			f.start = s;
+			break;
+		}
+		f.end = e;
+	}
+	return f;
+}
+
+Frag
+single(DFA *d, int type) {
+	Frag f;
+
+	/* a node of the given type followed by an open end */
+	f.start = node(d, type);
+	f.end = node(d, NEps);
+	if(!d->err)
+		d->nodes[f.start].out = f.end;
+	return f;
+}
+
+int
+step(DFA *d, int st, int c) {
+	int i, n = 0, next, flushes = d->flushes;
+	Node *nd;
+
+	for(i = 0; i < d->states[st].n; i++) {
+		nd = &d->nodes[d->states[st].set[i]];
+		if(nd->type == NSet && INSET(nd->set, c))
+			d->seeds[n++] = nd->out;
+	}
+	/* restart at every position, so a match may also begin anywhere */
+	d->seeds[n++] = d->start;
+	n = closure(d, d->seeds, n, 0, 0, d->buf);
+	next = addstate(d, d->buf, n, 0);
+	/* a flush has freed st, so only an intact cache records the edge */
+	if(next >= 0 && d->flushes == flushes)
+		d->states[st].next[c] = next;
+	return next;
+}
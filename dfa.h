@@ -0,0 +1,7 @@
+/* See LICENSE file for copyright and license details. */
+
+typedef struct DFA DFA; /* regular expression, matched by a lazily built DFA */
+
+DFA *dfacompile(const char *re, int icase);
+void dfafree(DFA *dfa);
+int dfamatch(DFA *dfa, const char *s);
@@ -1,10 +1,17 @@
 /* See LICENSE file for copyright and license details. */
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/stat.h>
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
 #include <X11/Xutil.h>
@@ -12,39 +19,158 @@
 #ifdef XINERAMA
 #include <X11/extensions/Xinerama.h>
 #endif
+#include "dfa.h"
 #include "draw.h"
 
 #define INTERSECT(x,y,w,h,r)  (MAX(0, MIN((x)+(w),(r).x_org+(r).width)  - MAX((x),(r).x_org)) \
                              * MAX(0, MIN((y)+(h),(r).y_org+(r).height) - MAX((y),(r).y_org)))
 #define MIN(a,b)              ((a) < (b) ? (a) : (b))
 #define MAX(a,b)              ((a) > (b) ? (a) : (b))
+#define LENGTH(X)             (sizeof X / sizeof X[0])
+#define ROWEQ(a,b)            ((a).item == (b).item && (a).sel == (b).sel && (a).w == (b).w)
 #define DEFFONT "fixed" /* xft example: "Monospace-11" */
+#define INCACHE(s)            (cachestr && (s) >= cachestr && (s) < cachestr + cachestrsize)
+#define NMARKS 256 /* memoized highlights, direct-mapped by item */
+#define ZBLOCK 32 /* packed items per block, each block starting with a whole item */
+#define HISTMAGIC "DMH1"
+#define CACHEMAGIC "DMC1"
+
+enum { TierExact, TierPrefix, TierSubstr, TierLast }; /* match tiers, in order */
+
+enum { SlotInput, SlotLeft, SlotItem, SlotRight }; /* layout slot kinds */
+enum { CacheFolded = 1 << 0 }; /* optional item cache sections */
 
 typedef struct Item Item;
 struct Item {
 	char *text;
+	char *out; /* printed when selected; text unless -m and -o differ */
 	Item *left, *right;
+	unsigned int score; /* frecency, 0 if never selected */
 };
 
+typedef struct {
+	char magic[4];
+	unsigned int flags;   /* optional sections present */
+	unsigned int nitems;
+	unsigned int longest; /* index of the longest item, for inputw */
+	unsigned int strsize; /* size of the string section */
+} CacheHeader; /* item cache: a CacheHeader, nitems string offsets, the strings
+                * and, with CacheFolded, a lowercased copy of the strings */
+
+typedef struct {
+	char magic[4];
+	unsigned int size; /* number of slots, a power of two */
+} HistHeader;
+
+typedef struct {
+	unsigned int hash; /* of the item text, 0 for an empty slot */
+	unsigned int count;
+	unsigned int last; /* time of last selection */
+} HistEntry; /* history store: a HistHeader followed by an open-addressed table */
+
+typedef struct {
+	int tier;
+	unsigned int score;
+	char *out;
+} HotLine; /* a previously selected line, held back by -F */
+
+typedef struct {
+	unsigned int id;    /* index of a packed item */
+	unsigned int score; /* its frecency, never 0 */
+} PackHot;
+
+typedef struct {
+	int kind;
+	int x, y, w, h;
+	Item *item;
+} Slot; /* rectangle of an element as last drawn by drawmenu() */
+
+typedef struct {
+	Item *item;  /* NULL for an unused entry */
+	int n;
+	Span span[8]; /* where the first tokens occur, merged */
+} Mark; /* highlights of an item for the current tokens */
+
+typedef struct {
+	Item *item; /* NULL for a blank row */
+	Bool sel;
+	int w;      /* 0 if the row must be drawn afresh */
+} Row; /* a row of the vertical list as the canvas holds it */
+
+static unsigned int approxinit(void);
 static void appenditem(Item *item, Item **list, Item **last);
+static void bufline(char **buf, size_t *len, size_t *size, const char *s, size_t n);
+static void appendlist(Item *list, Item *last);
 static void buttonpress(XEvent *e);
 static void calcoffsets(void);
 static void cleanup(void);
+static void compactitems(void);
+static Bool control(char *cmd);
+static Item *finditem(const char *s);
+static void flushrows(Item *item);
+static void freetext(Item *item);
 static char *cistrstr(const char *s, const char *sub);
+static void drawitem(Item *item, ColorSet *col);
 static void drawmenu(void);
+static void drawrows(void);
+static unsigned int editdist(const char *s, const unsigned long *peq, unsigned int m);
+static const char *field(const char *s, unsigned int n, size_t *len);
+static int filter(void);
+static const char *filterfield(const char *line);
+static unsigned int histhash(const char *s);
+static HistEntry *histlookup(HistEntry *tab, unsigned int size, unsigned int h);
+static unsigned int histscore(const char *s);
 static void highlightmenu(XEvent *e);
+static void indexitem(Item *item);
+static Slot *hittest(int x, int y);
 static void grabmouse(void);
 static void grabkeyboard(void);
 static void insert(const char *str, ssize_t n);
+static void inserthot(Item *item, Item **list, Item **last);
+static int itemtier(Item *item);
 static void keypress(XKeyEvent *ev);
+static Bool linkitem(Item *item);
+static void loadhistory(void);
+static Mark *mark(Item *item);
+static void addslot(int kind, Item *item);
 static void match(void);
+static void matchapprox(void);
+static void matchpacked(void);
+static int matchtier(const char *s, Bool folded);
+static void moveitems(size_t size);
 static size_t nextrune(int inc);
+static Bool onpage(Item *item);
+static FILE *openaside(const char *file, char *tmp, size_t size);
+static void packfill(Item *item, size_t p);
+static unsigned int packid(size_t p);
+static Item *packitem(size_t p);
+static unsigned int packscore(unsigned int id);
+static void packwindow(void);
 static void paste(void);
+static void readcache(void);
+static void readctl(void);
+static void readpacked(void);
 static void readstdin(void);
+static Bool renameaside(FILE *fp, const char *tmp, const char *file);
 static void run(void);
+static void savehistory(const char *s);
+static void setitem(Item *item, const char *line);
 static void setup(void);
+static void tokenize(void);
+static unsigned int typos(const char *s);
+static void typeahead(void);
+static void unpack(unsigned int id, char *buf);
+static Bool unlinkitem(Item *item);
 static void usage(void);
+static Bool widen(Item *item);
+static int writecache(const char *file);
 static void read_resources(void);
+#ifdef BENCH
+static void benchend(void);
+static void benchkey(KeySym ksym);
+static void benchstart(void);
+static void replay(const char *file);
+#endif
 
 static char text[BUFSIZ] = "";
 static int bh, mw, mh;
@@ -55,29 +181,83 @@ static const char *normbgcolor = NULL;
 static const char *normfgcolor = NULL;
 static const char *selbgcolor  = NULL;
 static const char *selfgcolor  = NULL;
+static const char *hibgcolor = NULL;
+static const char *hifgcolor = NULL;
 static unsigned int lines = 0, line_height = 0;
+static unsigned int maxtypos = 0;
 static int xoffset = 0;
 static int yoffset = 0;
 static int width = 0;
 static ColorSet *normcol;
 static ColorSet *selcol;
+static ColorSet *hicol;
 static Atom clip, utf8;
 static Bool topbar = True;
 static Bool running = True;
 static int ret = 0;
 static DC *dc;
 static Item *items = NULL;
+static size_t nitems = 0, itemsize = 0; /* items in use and allocated */
 static Item *matches, *matchend;
+static Item *tierend[2*TierLast]; /* last item of each tier, hot then cold */
+static unsigned int nmatched = 0; /* items in the tiers */
+static Bool approxed = False;     /* near misses follow the tiers */
+static char gone[] = "";          /* text of removed items */
+static size_t ngone = 0;
+static int ctlfd = -1;
+static unsigned int *itemidx = NULL; /* items by output, as index plus one, see finditem() */
+static size_t nitemidx = 0, itemidxsize = 0;
+static char delim = '\t';
+static unsigned int mfield = 0, ofield = 0; /* fields shown and printed, 0 for all */
 static Item *prev, *curr, *next, *sel;
 static Window win;
 static XIC xic;
+static const char *cachefile = NULL;
+static const char *cachestr = NULL, *cachefold = NULL;
+static size_t cachestrsize = 0;
+static Bool foldcase = False;
+static Bool regex = False;
+static DFA *dfa = NULL;
+static const char *histfile = NULL;
+static HistEntry *hist = NULL;
+static unsigned int histsize = 0;
+static size_t histmaplen = 0;
+static Slot *slots = NULL;
+static int nslots = 0;
+static Row *rows = NULL, *page = NULL; /* drawn and wanted rows, with -l */
+static Mark marks[NMARKS];
+static Bool packed = False;
+static char *pack = NULL;           /* front-coded items, see readpacked() */
+static size_t *packidx = NULL;      /* offset of each block in pack */
+static PackHot *packhot = NULL;     /* packed items with history, by id */
+static unsigned int npackhot = 0;
+static unsigned int *packtier[2*TierLast]; /* ids of matching packed items, as tierend */
+static size_t npacktier[2*TierLast], packtiersize[2*TierLast];
+static Item *packitems = NULL;      /* the first and last match, then a ring around curr */
+static size_t *packat = NULL;       /* match position each of packitems holds */
+static size_t packr = 0;            /* matches kept either side of curr */
+static unsigned long (*peq)[UCHAR_MAX+1] = NULL; /* token match masks, see approxinit() */
+static unsigned int *toklens = NULL, *maxerr = NULL;
+static int peqn = 0;
+static char **tokv = NULL;
+static int tokc = 0;
+static size_t toklen = 0;
+
+#ifdef BENCH
+static const char *script = NULL;
+static struct timespec benchts;
+static unsigned long benchreq, benchext;
+static unsigned long nframes = 0, nreqs = 0, nexts = 0;
+static double frametime = 0, maxframetime = 0;
+#endif
 
 static int (*fstrncmp)(const char *, const char *, size_t) = strncmp;
 static char *(*fstrstr)(const char *, const char *) = strstr;
 
 int
 main(int argc, char *argv[]) {
-	Bool fast = False;
+	Bool fast = False, raster = False;
+	const char *query = NULL;
 	int i;
 
 	for(i = 1; i < argc; i++)
@@ -93,7 +273,14 @@ main(int argc, char *argv[]) {
 		else if(!strcmp(argv[i], "-i")) { /* case-insensitive item matching */
 			fstrncmp = strncasecmp;
 			fstrstr = cistrstr;
+			foldcase = True;
 		}
+		else if(!strcmp(argv[i], "-r"))   /* input is a regular expression */
+			regex = True;
+		else if(!strcmp(argv[i], "-R"))   /* renders the menu on the client */
+			raster = True;
+		else if(!strcmp(argv[i], "-z"))   /* keeps items front-coded in memory */
+			packed = True;
 		else if(i+1 == argc)
 			usage();
 		/* these options take one argument */
@@ -107,32 +294,139 @@ main(int argc, char *argv[]) {
 			lines = atoi(argv[++i]);
 		else if(!strcmp(argv[i], "-h"))   /* minimum height of single line */
 			line_height = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-t"))   /* typos tolerated per token when few items match */
+			maxtypos = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-fn"))  /* font or font set */
+			font = argv[++i];
+		else if(!strcmp(argv[i], "-c"))   /* reads items from a binary item cache */
+			cachefile = argv[++i];
+		else if(!strcmp(argv[i], "-C"))   /* writes stdin to a binary item cache */
+			return writecache(argv[++i]);
+		else if(!strcmp(argv[i], "-H"))   /* ranks items by selection history */
+			histfile = argv[++i];
+		else if(!strcmp(argv[i], "-F"))   /* filters stdin without opening a window */
+			query = argv[++i];
+		else if(!strcmp(argv[i], "-u"))   /* reads item updates from a file descriptor */
+			ctlfd = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-d")) { /* field delimiter, a single ASCII character */
+			if(!argv[++i][0] || argv[i][1] || argv[i][0] & 0x80)
+				usage();
+			delim = argv[i][0];
+		}
+		else if(!strcmp(argv[i], "-m"))   /* field matched and shown */
+			mfield = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-o"))   /* field printed */
+			ofield = atoi(argv[++i]);
+#ifdef BENCH
+		else if(!strcmp(argv[i], "-S"))   /* replays a benchmark session script */
+			script = argv[++i];
+#endif
 		else
 			usage();
 
+	if(cachefile && (mfield || ofield))
+		eprintf("cannot select fields of a cache\n");
+	if(packed && (cachefile || ctlfd >= 0 || mfield || ofield))
+		eprintf("cannot pack items from a cache, with updates or with fields\n");
+	if(query) {
+		if(cachefile || packed || ctlfd >= 0)
+			eprintf("cannot filter a cache, packed items or updates\n");
+		strncpy(text, query, sizeof text - 1);
+		if(histfile)
+			loadhistory();
+		return filter();
+	}
+	if(ctlfd >= 0 && fcntl(ctlfd, F_GETFD) == -1)
+		eprintf("cannot read update fd %d:", ctlfd);
 	dc = initdc();
+	dc->raster = raster;
 	read_resources();
 	initfont(dc, font ? font : DEFFONT);
 	normcol = initcolor(dc, normfgcolor, normbgcolor);
 	selcol = initcolor(dc, selfgcolor, selbgcolor);
+	hicol = initcolor(dc, hifgcolor, hibgcolor);
+	if(histfile)
+		loadhistory();
 
 	if(fast) {
 		grabkeyboard();
 		grabmouse();
-		readstdin();
+		if(cachefile)
+			readcache();
+		else if(packed)
+			readpacked();
+		else
+			readstdin();
+		typeahead();
 	}
 	else {
-		readstdin();
+		if(cachefile)
+			readcache();
+		else if(packed)
+			readpacked();
+		else
+			readstdin();
 		grabkeyboard();
 		grabmouse();
 	}
 	setup();
+#ifdef BENCH
+	if(script)
+		replay(script);
+	else
+#endif
 	run();
 
 	cleanup();
 	return ret;
 }
 
+void
+addslot(int kind, Item *item) {
+	static int slotn = 0;
+
+	if(++nslots > slotn && !(slots = realloc(slots, (slotn += 16) * sizeof *slots)))
+		eprintf("cannot realloc %u bytes:", slotn * sizeof *slots);
+	slots[nslots-1].kind = kind;
+	slots[nslots-1].x = dc->x;
+	slots[nslots-1].y = dc->y;
+	slots[nslots-1].w = dc->w;
+	slots[nslots-1].h = dc->h;
+	slots[nslots-1].item = item;
+}
+
+unsigned int
+approxinit(void) {
+	unsigned int c, j;
+	int i;
+
+	if(tokc > peqn) {
+		peqn = tokc;
+		if(!(peq = realloc(peq, peqn * sizeof *peq))
+		|| !(toklens = realloc(toklens, peqn * sizeof *toklens))
+		|| !(maxerr = realloc(maxerr, peqn * sizeof *maxerr)))
+			eprintf("cannot realloc %u bytes:", peqn * sizeof *peq);
+	}
+	for(i = 0; i < tokc; i++) {
+		/* a token too long for a machine word must match exactly */
+		if((toklens[i] = strlen(tokv[i])) > sizeof(unsigned long) * CHAR_BIT) {
+			maxerr[i] = 0;
+			continue;
+		}
+		memset(peq[i], 0, sizeof peq[i]);
+		for(j = 0; j < toklens[i]; j++) {
+			c = (unsigned char)tokv[i][j];
+			peq[i][c] |= 1UL << j;
+			if(foldcase)
+				peq[i][toupper(c)] |= 1UL << j;
+		}
+		/* short tokens would match nearly anything, so allow them fewer typos */
+		maxerr[i] = MIN(maxtypos, (toklens[i] - 1) / 2);
+	}
+	/* the number of possible totals, including 0 */
+	return tokc * maxtypos + 1;
+}
+
 void
 appenditem(Item *item, Item **list, Item **last) {
 	if(*last)
@@ -145,14 +439,28 @@ appenditem(Item *item, Item **list, Item **last) {
 	*last = item;
 }
 
+void
+appendlist(Item *list, Item *last) {
+	if(matches) {
+		matchend->right = list;
+		list->left = matchend;
+	}
+	else
+		matches = list;
+	matchend = last;
+}
+
 void
 calcoffsets(void) {
 	int i, n;
 
+	/* packed matches are Items only around the page */
+	if(packitems)
+		packwindow();
 	if(lines > 0)
 		n = lines * bh;
-	else
-		n = mw - (inputw + textw(dc, "<") + textw(dc, ">"));
+	else /* even a menu too narrow for the arrows has a page of one item */
+		n = MAX(mw - (inputw + textw(dc, "<") + textw(dc, ">")), 1);
 	/* calculate which items will begin the next page and previous page */
 	for(i = 0, next = curr; next; next = next->right)
 		if((i += (lines > 0) ? bh : MIN(textw(dc, next->text), n)) > n)
@@ -174,94 +482,489 @@ cistrstr(const char *s, const char *sub) {
 
 void
 cleanup(void) {
+    if(hist)
+        munmap((HistHeader *)hist - 1, histmaplen);
     freecol(dc, normcol);
     freecol(dc, selcol);
+    freecol(dc, hicol);
     XDestroyWindow(dc->dpy, win);
     XUngrabKeyboard(dc->dpy, CurrentTime);
     freedc(dc);
 }
 
+void
+compactitems(void) {
+	size_t i, n;
+	Item *s = NULL;
+
+	for(i = n = 0; i < nitems; i++)
+		if(items[i].text != gone) {
+			if(&items[i] == sel)
+				s = &items[n];
+			items[n++] = items[i];
+		}
+	items[n].text = NULL;
+	nitems = n;
+	ngone = 0;
+	free(itemidx);
+	itemidx = NULL;
+	flushrows(NULL);
+	/* the links are stale, so list the items afresh, keeping the selection */
+	match();
+	if(s && (s == matches || s->left))
+		curr = sel = s;
+}
+
+Bool
+control(char *cmd) {
+	char *arg, *p;
+	Item *item;
+	Bool damaged;
+
+	/* c on its own, or a command letter, a space and its argument; any
+	 * other line is ignored */
+	if(strcmp(cmd, "c") && (!cmd[0] || cmd[1] != ' '))
+		return False;
+	arg = &cmd[2];
+	switch(cmd[0]) {
+	case 'a': /* append an item */
+		if(nitems + 1 >= itemsize)
+			moveitems(MAX(2 * itemsize, 64));
+		item = &items[nitems++];
+		setitem(item, arg);
+		item->left = item->right = NULL;
+		items[nitems].text = NULL;
+		if(itemidx)
+			indexitem(item);
+		damaged = widen(item);
+		return linkitem(item) || damaged;
+	case 'd': /* remove an item */
+		if(!(item = finditem(arg)))
+			return False;
+		damaged = unlinkitem(item);
+		freetext(item);
+		item->text = item->out = gone;
+		/* removed items are skipped by every scan, so drop them once they
+		 * are half of all items */
+		if(++ngone > 64 && ngone > nitems / 2) {
+			compactitems();
+			return True;
+		}
+		return damaged;
+	case 'r': /* replace an item, given as its old output and new line separated by a tab */
+		if(!(p = strchr(arg, '\t')))
+			return False;
+		*p++ = '\0';
+		if(!(item = finditem(arg)))
+			return False;
+		damaged = unlinkitem(item);
+		freetext(item);
+		setitem(item, p);
+		if(itemidx)
+			indexitem(item);
+		flushrows(item);
+		damaged = widen(item) || damaged;
+		return linkitem(item) || damaged;
+	case 'c': /* remove all items */
+		if(cmd[1])
+			return False;
+		for(item = items; item && item->text; item++)
+			freetext(item);
+		if(items)
+			items[0].text = NULL;
+		nitems = nmatched = ngone = 0;
+		memset(tierend, 0, sizeof tierend);
+		free(itemidx);
+		itemidx = NULL;
+		flushrows(NULL); /* the items will be reused */
+		matches = matchend = prev = curr = next = sel = NULL;
+		return True;
+	}
+	return False;
+}
+
+void
+drawitem(Item *item, ColorSet *col) {
+	Mark *m = mark(item);
+
+	drawspans(dc, item->text, m->span, m->n, col, hicol);
+}
+
 void
 drawmenu(void) {
 	int curpos;
 	Item *item;
 
+#ifdef BENCH
+	benchstart();
+#endif
 	dc->x = 0;
 	dc->y = 0;
 	dc->h = bh;
-	drawrect(dc, 0, 0, mw, mh, True, normcol->BG);
+	/* list rows keep what is still valid of them, see drawrows() */
+	drawrect(dc, 0, 0, mw, (lines > 0) ? bh : mh, True, normcol->BG);
 
 	/* draw input field */
+	nslots = 0;
 	dc->w = (lines > 0 || !matches) ? mw - dc->x : inputw;
 	drawtext(dc, text, normcol);
 	if((curpos = textnw(dc, text, cursor) + dc->font.height/2) < dc->w)
 		drawrect(dc, curpos, (dc->h - dc->font.height)/2 + 1, 1, dc->font.height -1, True, normcol->FG);
+	/* clicks in the space reserved for a missing left arrow go to the input */
+	if(lines <= 0 && matches && !curr->left)
+		dc->w += textw(dc, "<");
+	addslot(SlotInput, NULL);
 
   if(lines > 0) {
       /* draw vertical list */
       dc->w = mw - dc->x;
-      for(item = curr; item != next; item = item->right) {
-          dc->y += dc->h;
-          drawtext(dc, item->text, (item == sel) ? selcol : normcol);
-      }
+      drawrows();
   }
   else if(matches) {
       /* draw horizontal list */
       dc->x += inputw;
       dc->w = textw(dc, "<");
-      if(curr->left)
+      if(curr->left) {
           drawtext(dc, "<", normcol);
+          addslot(SlotLeft, NULL);
+      }
       for(item = curr; item != next; item = item->right) {
           dc->x += dc->w;
           dc->w = MIN(textw(dc, item->text), mw - dc->x - textw(dc, ">"));
-          drawtext(dc, item->text, (item == sel) ? selcol : normcol);
+          drawitem(item, (item == sel) ? selcol : normcol);
+          addslot(SlotItem, item);
       }
       dc->w = textw(dc, ">");
       dc->x = mw - dc->w;
-      if(next)
+      if(next) {
           drawtext(dc, ">", normcol);
+          addslot(SlotRight, NULL);
+      }
   }
 	mapdc(dc, win, mw, mh);
+#ifdef BENCH
+	benchend();
+#endif
 }
 
-static void highlightmenu(XEvent *e) {
+void
+drawrows(void) {
+	int best = 0, d = 0, i, j, k, m, n, top;
 	Item *item;
-	XButtonPressedEvent *ev = &e->xbutton;
 
-	dc->x = 0;
-	dc->y = 0;
-	dc->h = bh;
-
-	if(lines > 0) {
-		/* vertical list: left-click on item */
-		dc->w = mw - dc->x;
-		for(item = curr; item != next; item = item->right) {
-			dc->y += dc->h;
-			if(ev->y >= dc->y && ev->y <= (dc->y + dc->h)) {
-				if (item != sel) {
-					sel = item;
-					drawmenu();
+#define KEPT(i) (d != 0 && page[i].item && (i) + d >= 0 && (i) + d < (int)lines \
+                 && ROWEQ(page[i], rows[(i) + d]))
+	for(n = 0, item = curr; item != next; item = item->right, n++) {
+		page[n].item = item;
+		page[n].sel = (item == sel);
+		page[n].w = dc->w;
+	}
+	for(i = n; i < (int)lines; i++) {
+		page[i].item = NULL;
+		page[i].sel = False;
+		page[i].w = dc->w;
+	}
+	/* a scroll shifts the rows by as much as the first or last item moved */
+	for(k = 0; k < 2 && n > 0; k++)
+		for(j = 0; j < (int)lines; j++)
+			if(rows[j].item == page[k ? n - 1 : 0].item) {
+				for(m = 0, i = 0; i < n; i++)
+					if(i + j - (k ? n - 1 : 0) >= 0 && i + j - (k ? n - 1 : 0) < (int)lines
+					&& ROWEQ(page[i], rows[i + j - (k ? n - 1 : 0)]))
+						m++;
+				if(m > best) {
+					best = m;
+					d = j - (k ? n - 1 : 0);
 				}
-				return;
+				break;
 			}
+	/* copy the rows that moved in runs, top down when they move up and bottom
+	 * up otherwise, so that no run overwrites the source of another */
+	for(k = 0; d != 0 && k < n; k++) {
+		i = (d > 0) ? k : n - 1 - k;
+		if(!KEPT(i))
+			continue;
+		for(m = 1; k + m < n && KEPT((d > 0) ? i + m : i - m); m++);
+		top = (d > 0) ? i : i - m + 1;
+		copydc(dc, 0, bh * (top + d + 1), dc->w, bh * m, 0, bh * (top + 1));
+		k += m - 1;
+	}
+	/* and draw only the rows that changed */
+	for(i = 0; i < (int)lines; i++) {
+		dc->y = bh * (i + 1);
+		if(!KEPT(i) && !ROWEQ(page[i], rows[i])) {
+			if(page[i].item)
+				drawitem(page[i].item, page[i].sel ? selcol : normcol);
+			else
+				drawrect(dc, 0, 0, dc->w, dc->h, True, normcol->BG);
 		}
+		if(page[i].item)
+			addslot(SlotItem, page[i].item);
 	}
-	else {
-		/* horizontal list: left-click on item */
-		dc->w = inputw;
-		for(item = curr; item != next; item = item->right) {
-			dc->x += dc->w;
-			if(ev->x >= dc->x && ev->x <= (dc->x + dc->w)) {
-				if (item != sel) {
-					sel = item;
-					drawmenu();
-				}
-				return;
+#undef KEPT
+	memcpy(rows, page, lines * sizeof *rows);
+}
+
+unsigned int
+editdist(const char *s, const unsigned long *peq, unsigned int m) {
+	unsigned long pv = ~0UL, mv = 0, eq, xv, xh, ph, mh, hb = 1UL << (m - 1);
+	unsigned int score = m, best = m;
+
+	/* Myers' bit-parallel edit distance between a pattern of m bytes, given
+	 * by its match masks, and the best matching substring of s */
+	for(; *s; s++) {
+		eq = peq[(unsigned char)*s];
+		xv = eq | mv;
+		xh = (((eq & pv) + pv) ^ pv) | eq;
+		ph = mv | ~(xh | pv);
+		mh = pv & xh;
+		if(ph & hb)
+			score++;
+		else if(mh & hb)
+			score--;
+		ph <<= 1;
+		mh <<= 1;
+		pv = mh | ~(xv | ph);
+		mv = ph & xv;
+		if(score < best && (best = score) == 0)
+			break;
+	}
+	return best;
+}
+
+const char *
+field(const char *s, unsigned int n, size_t *len) {
+	const char *f, *end;
+
+	/* field n of s, counting from 1, or all of s for 0 or a missing field */
+	for(f = s; n > 1 && (f = strchr(f, delim)); n--)
+		f++;
+	if(!f) {
+		*len = strlen(s);
+		return s;
+	}
+	*len = (n == 1 && (end = strchr(f, delim))) ? (size_t)(end - f) : strlen(f);
+	return f;
+}
+
+int
+filter(void) {
+	static char obuf[1 << 16];
+	char buf[sizeof text], *p, *tbuf[TierLast], *miss = NULL;
+	const char *o;
+	size_t i, j, len, nhot = 0, hotsize = 0, nmiss = 0, misslen = 0, misssize = 0;
+	size_t tlen[TierLast], tsize[TierLast];
+	unsigned int d, nb, score, *dist = NULL, found = 0;
+	int t;
+	Bool approx;
+	HotLine *hot = NULL;
+
+	/* the output is ranked as match() ranks the menu; exact matches are
+	 * streamed as they are read, unless history may put others first */
+	setvbuf(stdout, obuf, _IOFBF, sizeof obuf);
+	if(regex && !(dfa = dfacompile(text, foldcase)))
+		eprintf("invalid regular expression '%s'\n", text);
+	tokenize();
+	approx = maxtypos > 0 && !regex && tokc > 0;
+	for(t = 0; t < TierLast; t++) {
+		tbuf[t] = NULL;
+		tlen[t] = tsize[t] = 0;
+	}
+	while(fgets(buf, sizeof buf, stdin)) {
+		if((p = strchr(buf, '\n')))
+			*p = '\0';
+		if((t = matchtier(filterfield(buf), False)) < 0) {
+			/* near misses are only listed if few lines match, so keep them */
+			if(approx) {
+				bufline(&miss, &misslen, &misssize, buf, strlen(buf));
+				miss[misslen - 1] = '\0';
+				nmiss++;
 			}
+			continue;
+		}
+		found++;
+		o = field(buf, ofield, &len);
+		if(hist && (score = histscore(o))) {
+			/* hot lines are few; keep them by tier, then descending score */
+			if(nhot == hotsize && !(hot = realloc(hot, (hotsize += 64) * sizeof *hot)))
+				eprintf("cannot realloc %u bytes:", hotsize * sizeof *hot);
+			for(j = nhot++; j > 0 && (hot[j-1].tier > t
+			    || (hot[j-1].tier == t && hot[j-1].score < score)); j--)
+				hot[j] = hot[j-1];
+			hot[j].tier = t;
+			hot[j].score = score;
+			if(!(hot[j].out = malloc(len + 1)))
+				eprintf("cannot malloc %u bytes:", len + 1);
+			memcpy(hot[j].out, o, len);
+			hot[j].out[len] = '\0';
+		}
+		else if(t == TierExact && !hist) {
+			fwrite(o, 1, len, stdout);
+			putchar('\n');
+		}
+		else {
+			bufline(&tbuf[t], &tlen[t], &tsize[t], o, len);
+			tbuf[t][tlen[t] - 1] = '\n';
 		}
 	}
+	for(i = 0, t = 0; t < TierLast; t++) {
+		for(; i < nhot && hot[i].tier == t; i++) {
+			puts(hot[i].out);
+			free(hot[i].out);
+		}
+		if(tbuf[t]) {
+			fwrite(tbuf[t], 1, tlen[t], stdout);
+			free(tbuf[t]);
+		}
+	}
+	free(hot);
+	/* then, if that is too few to fill the menu, near misses, fewest edits first */
+	if(approx && found < MAX(lines, 1) && nmiss > 0) {
+		nb = approxinit();
+		if(!(dist = malloc(nmiss * sizeof *dist)))
+			eprintf("cannot malloc %u bytes:", nmiss * sizeof *dist);
+		for(i = 0, p = miss; i < nmiss; i++, p += strlen(p) + 1)
+			if((dist[i] = typos(filterfield(p))) > 0 && dist[i] < nb)
+				found++;
+		for(d = 1; d < nb; d++)
+			for(i = 0, p = miss; i < nmiss; i++, p += strlen(p) + 1)
+				if(dist[i] == d) {
+					o = field(p, ofield, &len);
+					fwrite(o, 1, len, stdout);
+					putchar('\n');
+				}
+		free(dist);
+	}
+	free(miss);
+	if(fflush(stdout) == EOF)
+		eprintf("cannot write to stdout:");
+	return found ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+const char *
+filterfield(const char *line) {
+	static char buf[sizeof text];
+	const char *m;
+	size_t len;
 
-	return;
+	/* the field matched, as a string of its own */
+	if(!mfield)
+		return line;
+	m = field(line, mfield, &len);
+	memcpy(buf, m, len);
+	buf[len] = '\0';
+	return buf;
+}
+
+unsigned int
+histhash(const char *s) {
+	unsigned int h = 2166136261U;
+
+	/* FNV-1a; 0 marks an empty slot */
+	for(; *s; s++)
+		h = (h ^ (unsigned char)*s) * 16777619U;
+	return h ? h : 1;
+}
+
+HistEntry *
+histlookup(HistEntry *tab, unsigned int size, unsigned int h) {
+	unsigned int i;
+
+	/* linear probing; returns the entry for h or the empty slot it belongs in */
+	for(i = h & (size - 1); tab[i].hash && tab[i].hash != h; i = (i + 1) & (size - 1));
+	return &tab[i];
+}
+
+unsigned int
+histscore(const char *s) {
+	static time_t now = 0;
+	HistEntry *e;
+	long age;
+
+	if(!hist)
+		return 0;
+	if(!now)
+		now = time(NULL);
+	if(!(e = histlookup(hist, histsize, histhash(s)))->hash)
+		return 0;
+	/* weight the selection count by how recently it was last made */
+	age = now - (time_t)e->last;
+	if(age < 4 * 3600)
+		return e->count * 100;
+	if(age < 24 * 3600)
+		return e->count * 70;
+	if(age < 7 * 24 * 3600)
+		return e->count * 50;
+	if(age < 30 * 24 * 3600)
+		return e->count * 30;
+	return e->count * 10;
+}
+
+Item *
+finditem(const char *s) {
+	size_t i;
+	Item *item, *found = NULL;
+
+	if(!itemidx)
+		indexitem(NULL);
+	/* removed and replaced items leave stale entries behind, so the whole
+	 * chain is searched for the first live item with this output */
+	for(i = histhash(s) & (itemidxsize - 1); itemidx[i]; i = (i + 1) & (itemidxsize - 1)) {
+		item = &items[itemidx[i] - 1];
+		if(item->text != gone && (!found || item < found) && !strcmp(item->out, s))
+			found = item;
+	}
+	return found;
+}
+
+void
+flushrows(Item *item) {
+	unsigned int i;
+
+	/* item, or all of them, must be drawn afresh */
+	for(i = 0; rows && i < lines; i++)
+		if(!item || rows[i].item == item)
+			rows[i].w = 0;
+	for(i = 0; i < NMARKS; i++)
+		if(!item || marks[i].item == item)
+			marks[i].item = NULL;
+}
+
+void
+freetext(Item *item) {
+	/* cached items point into the mapped cache */
+	if(item->text != gone && !INCACHE(item->text))
+		free(item->text);
+}
+
+void
+highlightmenu(XEvent *e) {
+	Slot *slot;
+
+	if((slot = hittest(e->xmotion.x, e->xmotion.y)) && slot->item && slot->item != sel) {
+		sel = slot->item;
+		drawmenu();
+	}
+}
+
+Slot *
+hittest(int x, int y) {
+	int lo, hi, mid, p;
+	Slot *slot;
+
+	/* slots are recorded in drawing order, so they are sorted along the list */
+	p = (lines > 0) ? y : x;
+	for(lo = 0, hi = nslots - 1; lo <= hi; ) {
+		mid = (lo + hi) / 2;
+		slot = &slots[mid];
+		if(p < ((lines > 0) ? slot->y : slot->x))
+			hi = mid - 1;
+		else if(p >= ((lines > 0) ? slot->y + slot->h : slot->x + slot->w))
+			lo = mid + 1;
+		else
+			return slot;
+	}
+	return NULL;
 }
 
 void grabmouse(void) {
@@ -303,6 +1006,57 @@ insert(const char *str, ssize_t n) {
 	match();
 }
 
+void
+inserthot(Item *item, Item **list, Item **last) {
+	Item *it;
+
+	/* keep the list ordered by descending score; there are few such items */
+	for(it = *list; it && it->score >= item->score; it = it->right);
+	if(!it) {
+		appenditem(item, list, last);
+		return;
+	}
+	item->left = it->left;
+	item->right = it;
+	if(it->left)
+		it->left->right = item;
+	else
+		*list = item;
+	it->left = item;
+}
+
+void
+indexitem(Item *item) {
+	size_t i;
+	Item *it;
+
+	/* add item, or index all items afresh, which also drops the stale
+	 * entries, when the load would exceed one half */
+	if(!item || (nitemidx + 1) * 2 > itemidxsize) {
+		for(itemidxsize = 64; itemidxsize < 4 * nitems; itemidxsize *= 2);
+		free(itemidx);
+		if(!(itemidx = calloc(itemidxsize, sizeof *itemidx)))
+			eprintf("cannot malloc %u bytes:", itemidxsize * sizeof *itemidx);
+		nitemidx = 0;
+		for(it = items; it && it->text; it++)
+			if(it->text != gone)
+				indexitem(it);
+		return;
+	}
+	for(i = histhash(item->out) & (itemidxsize - 1); itemidx[i]; i = (i + 1) & (itemidxsize - 1));
+	itemidx[i] = item - items + 1;
+	nitemidx++;
+}
+
+int
+itemtier(Item *item) {
+	if(item->text == gone)
+		return -1;
+	if(cachefold && INCACHE(item->text))
+		return matchtier(cachefold + (item->text - cachestr), True);
+	return matchtier(item->text, False);
+}
+
 void
 keypress(XKeyEvent *ev) {
 	char buf[32];
@@ -414,7 +1168,8 @@ keypress(XKeyEvent *ev) {
 		/* fallthrough */
 	case XK_Up:
 		if(sel && sel->left && (sel = sel->left)->right == curr) {
-			curr = prev;
+			/* a list scrolls by a row, so the others can be copied */
+			curr = (lines > 0) ? sel : prev;
 			calcoffsets();
 		}
 		break;
@@ -432,7 +1187,8 @@ keypress(XKeyEvent *ev) {
 		break;
 	case XK_Return:
 	case XK_KP_Enter:
-		puts((sel && !(ev->state & ShiftMask)) ? sel->text : text);
+		puts((sel && !(ev->state & ShiftMask)) ? sel->out : text);
+		savehistory((sel && !(ev->state & ShiftMask)) ? sel->out : text);
 		ret = EXIT_SUCCESS;
 		running = False;
 	case XK_Right:
@@ -445,7 +1201,7 @@ keypress(XKeyEvent *ev) {
 		/* fallthrough */
 	case XK_Down:
 		if(sel && sel->right && (sel = sel->right) == next) {
-			curr = next;
+			curr = (lines > 0) ? curr->right : next;
 			calcoffsets();
 		}
 		break;
@@ -460,10 +1216,21 @@ keypress(XKeyEvent *ev) {
 	drawmenu();
 }
 
+void
+bufline(char **buf, size_t *len, size_t *size, const char *s, size_t n) {
+	/* append s and one more byte, left for the caller */
+	if(*len + n + 1 > *size) {
+		*size = MAX(*size * 2, *len + n + 1 + BUFSIZ);
+		if(!(*buf = realloc(*buf, *size)))
+			eprintf("cannot realloc %u bytes:", *size);
+	}
+	memcpy(&(*buf)[*len], s, n);
+	*len += n + 1;
+}
+
 void
 buttonpress(XEvent *e) {
-	int curpos;
-	Item *item;
+	Slot *slot;
 	XButtonPressedEvent *ev = &e->xbutton;
 
 	/* left-click outside window: exit */
@@ -474,21 +1241,9 @@ buttonpress(XEvent *e) {
 	if(ev->button == Button3)
 		exit(EXIT_FAILURE);
 
-	dc->x = 0;
-	dc->y = 0;
-	dc->h = bh;
-
-	/* input field */
-	dc->w = (lines > 0 || !matches) ? mw - dc->x : inputw;
-	if((curpos = textnw(dc, text, cursor) + dc->h/2 - 2) < dc->w);
-
-	/* left-click on input: clear input,
-	 * NOTE: if there is no left-arrow the space for < is reserved so
-	 *       add that to the input width */
-	if(ev->button == Button1 &&
-	   ((lines <= 0 && ev->x >= 0 && ev->x <= dc->x + dc->w +
-	   ((!prev || !curr->left) ? textw(dc, "<") : 0)) ||
-	   (lines > 0 && ev->y >= dc->y && ev->y <= dc->y + dc->h))) {
+	slot = hittest(ev->x, ev->y);
+	/* left-click on input: clear input */
+	if(ev->button == Button1 && slot && slot->kind == SlotInput) {
 		insert(NULL, 0 - cursor);
 		drawmenu();
 		return;
@@ -514,104 +1269,323 @@ buttonpress(XEvent *e) {
 		drawmenu();
 		return;
 	}
-	if(ev->button != Button1)
+	if(ev->button != Button1 || !slot)
 		return;
-	if(lines > 0) {
-		/* vertical list: left-click on item */
-		dc->w = mw - dc->x;
-		for(item = curr; item != next; item = item->right) {
-			dc->y += dc->h;
-			if(ev->y >= dc->y && ev->y <= (dc->y + dc->h)) {
-				puts(item->text);
-				exit(EXIT_SUCCESS);
-			}
-		}
+	switch(slot->kind) {
+	case SlotItem: /* left-click on item */
+		puts(slot->item->out);
+		savehistory(slot->item->out);
+		exit(EXIT_SUCCESS);
+	case SlotLeft: /* left-click on left arrow */
+		sel = curr = prev;
+		calcoffsets();
+		drawmenu();
+		break;
+	case SlotRight: /* left-click on right arrow */
+		sel = curr = next;
+		calcoffsets();
+		drawmenu();
+		break;
 	}
-	else if(matches) {
-		/* left-click on left arrow */
-		dc->x += inputw;
-		dc->w = textw(dc, "<");
-		if(prev && curr->left) {
-			if(ev->x >= dc->x && ev->x <= dc->x + dc->w) {
-				sel = curr = prev;
-				calcoffsets();
-				drawmenu();
-				return;
-			}
+}
+
+Bool
+linkitem(Item *item) {
+	int i, s, t;
+	size_t j;
+	Item *after, *before, *it;
+
+	if((t = itemtier(item)) < 0)
+		return False;
+	s = item->score ? 2*t : 2*t+1;
+	/* the item's tier follows the last nonempty one before it */
+	for(i = s - 1; i >= 0 && !tierend[i]; i--);
+	before = (i >= 0) ? tierend[i] : NULL;
+	/* within it, as match() orders it: hot items by descending score, then
+	 * by place in items, which is all that orders cold ones */
+	after = tierend[s] ? tierend[s] : before;
+	if(item->score) /* there are few */
+		for(; after != before; after = after->left) {
+			if(after->score > item->score || (after->score == item->score && after < item))
+				break;
 		}
-		/* horizontal list: left-click on item */
-		for(item = curr; item != next; item = item->right) {
-			dc->x += dc->w;
-			dc->w = MIN(textw(dc, item->text), mw - dc->x - textw(dc, ">"));
-			if(ev->x >= dc->x && ev->x <= (dc->x + dc->w)) {
-				puts(item->text);
-				exit(EXIT_SUCCESS);
+	else /* look back from the tier's end and from the item at once */
+		for(j = item - items; after != before && after > item; after = after->left) {
+			if(j == 0) {
+				after = before;
+				break;
+			}
+			it = &items[--j];
+			if((it == matches || it->left) && !it->score && itemtier(it) == t) {
+				after = it;
+				break;
 			}
 		}
-		/* left-click on right arrow */
-		dc->w = textw(dc, ">");
-		dc->x = mw - dc->w;
-		if(next && ev->x >= dc->x && ev->x <= dc->x + dc->w) {
-			sel = curr = next;
-			calcoffsets();
-			drawmenu();
-			return;
-		}
+	item->left = after;
+	item->right = after ? after->right : matches;
+	if(item->right)
+		item->right->left = item;
+	else
+		matchend = item;
+	if(after)
+		after->right = item;
+	else
+		matches = item;
+	if(!tierend[s] || tierend[s] == after)
+		tierend[s] = item;
+	nmatched++;
+	return onpage(item);
+}
+
+void
+loadhistory(void) {
+	unsigned int i, used;
+	int fd;
+	struct stat st;
+	HistHeader *hdr;
+	void *map;
+
+	/* a missing or malformed store just means there is no history yet */
+	if((fd = open(histfile, O_RDONLY)) == -1)
+		return;
+	if(fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof *hdr
+	|| (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return;
+	}
+	close(fd);
+	hdr = map;
+	if(memcmp(hdr->magic, HISTMAGIC, sizeof hdr->magic) || !hdr->size
+	|| (hdr->size & (hdr->size - 1))
+	|| (size_t)st.st_size != sizeof *hdr + hdr->size * sizeof *hist) {
+		munmap(map, st.st_size);
+		return;
+	}
+	hist = (HistEntry *)(hdr + 1);
+	histsize = hdr->size;
+	histmaplen = st.st_size;
+	/* probing relies on the table never being full */
+	for(i = 0, used = 0; i < histsize; i++)
+		if(hist[i].hash)
+			used++;
+	if(used == histsize) {
+		munmap(map, st.st_size);
+		hist = NULL;
+		histsize = 0;
 	}
 }
 
+Mark *
+mark(Item *item) {
+	Mark *m = &marks[(unsigned long)item / sizeof *item % NMARKS];
+	Span sp;
+	char *s;
+	int i, j;
+
+	/* the tokens are searched for once per match, not once per frame */
+	if(m->item == item)
+		return m;
+	m->item = item;
+	m->n = 0;
+	for(i = 0; !dfa && i < tokc && m->n < (int)LENGTH(m->span); i++)
+		if((s = fstrstr(item->text, tokv[i]))) {
+			sp.off = s - item->text;
+			sp.len = strlen(tokv[i]);
+			for(j = m->n++; j > 0 && m->span[j-1].off > sp.off; j--)
+				m->span[j] = m->span[j-1];
+			m->span[j] = sp;
+		}
+	/* overlapping tokens make one span */
+	for(i = 0, j = 1; j < m->n; j++)
+		if(m->span[j].off <= m->span[i].off + m->span[i].len)
+			m->span[i].len = MAX(m->span[i].len, m->span[j].off + m->span[j].len - m->span[i].off);
+		else
+			m->span[++i] = m->span[j];
+	m->n = MIN(m->n, i + 1);
+	return m;
+}
+
 void
 match(void) {
-	static char **tokv = NULL;
-	static int tokn = 0;
+	int t;
+	unsigned int n;
+	Item *item, *tier[2*TierLast];
+	DFA *re;
 
-	char buf[sizeof text], *s;
-	int i, tokc = 0;
-	size_t len;
-	Item *item, *lprefix, *lsubstr, *prefixend, *substrend;
+	if(regex) {
+		/* keep the last results while the expression is incomplete */
+		if(!(re = dfacompile(text, foldcase)))
+			return;
+		dfafree(dfa);
+		dfa = re;
+	}
+	tokenize();
+	flushrows(NULL); /* the highlights follow the tokens */
+	if(packed) {
+		matchpacked();
+		curr = sel = matches;
+		calcoffsets();
+		return;
+	}
+	for(t = 0; t < 2*TierLast; t++)
+		tier[t] = tierend[t] = NULL;
+	/* within each tier, previously selected items go first by frecency */
+	for(n = 0, item = items; item && item->text; item++)
+		if((t = itemtier(item)) >= 0) {
+			if(item->score)
+				inserthot(item, &tier[2*t], &tierend[2*t]);
+			else
+				appenditem(item, &tier[2*t+1], &tierend[2*t+1]);
+			n++;
+		}
+		else /* so that listed items are exactly those with links */
+			item->left = item->right = NULL;
+	/* exact matches go first, then prefixes, then substrings */
+	matches = matchend = NULL;
+	for(t = 0; t < 2*TierLast; t++)
+		if(tier[t])
+			appendlist(tier[t], tierend[t]);
+	/* then, if that is too few to fill the menu, near misses */
+	nmatched = n;
+	if((approxed = (maxtypos > 0 && !regex && tokc > 0 && n < MAX(lines, 1))))
+		matchapprox();
+	curr = sel = matches;
+	calcoffsets();
+}
 
-	strcpy(buf, text);
-	/* separate input text into tokens to be matched individually */
-	for(s = strtok(buf, " "); s; tokv[tokc-1] = s, s = strtok(NULL, " "))
-		if(++tokc > tokn && !(tokv = realloc(tokv, ++tokn * sizeof *tokv)))
-			eprintf("cannot realloc %u bytes\n", tokn * sizeof *tokv);
-	len = tokc ? strlen(tokv[0]) : 0;
+void
+matchapprox(void) {
+	static Item **bucket = NULL, **bucketend = NULL;
+	static unsigned int bucketn = 0;
+	unsigned int d, nb;
+	Item *item;
 
-	matches = lprefix = lsubstr = matchend = prefixend = substrend = NULL;
-	for(item = items; item && item->text; item++) {
-		for(i = 0; i < tokc; i++)
-			if(!fstrstr(item->text, tokv[i]))
-				break;
-		if(i != tokc) /* not all tokens match */
+	nb = approxinit();
+	if(nb > bucketn) {
+		bucketn = nb;
+		if(!(bucket = realloc(bucket, bucketn * sizeof *bucket))
+		|| !(bucketend = realloc(bucketend, bucketn * sizeof *bucketend)))
+			eprintf("cannot realloc %u bytes:", bucketn * sizeof *bucket);
+	}
+	for(d = 0; d < nb; d++)
+		bucket[d] = bucketend[d] = NULL;
+	for(item = items; item && item->text; item++)
+		/* a total of 0 means the item already matched exactly */
+		if(item->text != gone && (d = typos(item->text)) > 0 && d < nb)
+			appenditem(item, &bucket[d], &bucketend[d]);
+	/* fewest edits first */
+	for(d = 1; d < nb; d++)
+		if(bucket[d])
+			appendlist(bucket[d], bucketend[d]);
+}
+
+void
+matchpacked(void) {
+	char buf[sizeof text], *s;
+	const char *p = pack;
+	unsigned int i, h = 0, score, *tier;
+	size_t j, n;
+	int k, t;
+
+	for(k = 0; k < 2*TierLast; k++)
+		npacktier[k] = 0;
+	/* decode every item in one pass: how much it shares with the one before,
+	 * then the rest of it */
+	for(i = 0; i < nitems; i++) {
+		for(s = buf + (unsigned char)*p++; (*s++ = *p++); );
+		if((t = matchtier(buf, False)) < 0)
 			continue;
-		/* exact matches go first, then prefixes, then substrings */
-		if(!tokc || !fstrncmp(tokv[0], item->text, len+1))
-			appenditem(item, &matches, &matchend);
-		else if(!fstrncmp(tokv[0], item->text, len))
-			appenditem(item, &lprefix, &prefixend);
-		else
-			appenditem(item, &lsubstr, &substrend);
+		for(; h < npackhot && packhot[h].id < i; h++);
+		score = (h < npackhot && packhot[h].id == i) ? packhot[h].score : 0;
+		k = score ? 2*t : 2*t+1;
+		if(npacktier[k] == packtiersize[k]) {
+			packtiersize[k] = MAX(2 * packtiersize[k], BUFSIZ);
+			if(!(packtier[k] = realloc(packtier[k], packtiersize[k] * sizeof **packtier)))
+				eprintf("cannot realloc %u bytes:", packtiersize[k] * sizeof **packtier);
+		}
+		/* hot items stay ordered by descending score; there are few */
+		tier = packtier[k];
+		for(j = npacktier[k]++; score && j > 0 && packscore(tier[j-1]) < score; j--)
+			tier[j] = tier[j-1];
+		tier[j] = i;
 	}
-	if(lprefix) {
-		if(matches) {
-			matchend->right = lprefix;
-			lprefix->left = matchend;
+	for(n = 0, k = 0; k < 2*TierLast; k++) {
+		n += npacktier[k];
+		/* give back what a broader match needed */
+		if(packtiersize[k] > 4 * MAX(npacktier[k], BUFSIZ)
+		&& (tier = realloc(packtier[k], 2 * MAX(npacktier[k], BUFSIZ) * sizeof *tier))) {
+			packtier[k] = tier;
+			packtiersize[k] = 2 * MAX(npacktier[k], BUFSIZ);
 		}
-		else
-			matches = lprefix;
-		matchend = prefixend;
 	}
-	if(lsubstr) {
-		if(matches) {
-			matchend->right = lsubstr;
-			lsubstr->left = matchend;
+	nmatched = n;
+	approxed = False;
+	/* the old positions mean nothing now */
+	for(j = 0; j < 2 * packr + 3; j++)
+		packat[j] = (size_t)-1;
+	matches = matchend = NULL;
+	if(n > 0) {
+		packfill(matches = packitem(0), 0);
+		if(n > 1)
+			packfill(packitem(n - 1), n - 1);
+		matchend = packitem(n - 1);
+	}
+}
+
+int
+matchtier(const char *s, Bool folded) {
+	int i;
+	int (*ncmp)(const char *, const char *, size_t) = folded ? strncmp : fstrncmp;
+	char *(*str)(const char *, const char *) = folded ? strstr : fstrstr;
+
+	if(dfa) /* everything the expression matches ranks alike */
+		return dfamatch(dfa, s) ? TierExact : -1;
+	/* folded text is already lowercase, as are the tokens under -i */
+	for(i = 0; i < tokc; i++)
+		if(!str(s, tokv[i]))
+			return -1; /* not all tokens match */
+	if(!tokc || !ncmp(tokv[0], s, toklen+1))
+		return TierExact;
+	else if(!ncmp(tokv[0], s, toklen))
+		return TierPrefix;
+	return TierSubstr;
+}
+
+void
+moveitems(size_t size) {
+	Item *p;
+	size_t i;
+	int j;
+
+#define MOVE(x) ((x) ? p + ((x) - items) : NULL)
+	if(!(p = malloc(size * sizeof *p)))
+		eprintf("cannot malloc %u bytes:", size * sizeof *p);
+	/* the links are carried over, so the matches and selection survive */
+	if(items) {
+		memcpy(p, items, (nitems + 1) * sizeof *p);
+		for(i = 0; i < nitems; i++) {
+			p[i].left = MOVE(p[i].left);
+			p[i].right = MOVE(p[i].right);
 		}
-		else
-			matches = lsubstr;
-		matchend = substrend;
+		matches = MOVE(matches);
+		matchend = MOVE(matchend);
+		prev = MOVE(prev);
+		curr = MOVE(curr);
+		next = MOVE(next);
+		sel = MOVE(sel);
+		for(j = 0; j < 2*TierLast; j++)
+			tierend[j] = MOVE(tierend[j]);
+		for(j = 0; j < nslots; j++)
+			slots[j].item = MOVE(slots[j].item);
+		for(j = 0; rows && j < (int)lines; j++)
+			rows[j].item = MOVE(rows[j].item);
+		for(j = 0; j < NMARKS; j++)
+			marks[j].item = NULL;
 	}
-	curr = sel = matches;
-	calcoffsets();
+#undef MOVE
+	free(items);
+	items = p;
+	itemsize = size;
 }
 
 size_t
@@ -623,6 +1597,103 @@ nextrune(int inc) {
 	return n;
 }
 
+Bool
+onpage(Item *item) {
+	Item *it;
+
+	/* the page and its neighbours, which decide the arrows */
+	if(!curr)
+		return True;
+	for(it = curr->left ? curr->left : curr; it; it = it->right)
+		if(it == item)
+			return True;
+		else if(it == next)
+			break;
+	return False;
+}
+
+FILE *
+openaside(const char *file, char *tmp, size_t size) {
+	FILE *fp;
+	int fd;
+
+	/* the file is written beside its destination and renamed into place, so
+	 * that no reader ever sees it partly written */
+	if((size_t)snprintf(tmp, size, "%s.XXXXXX", file) >= size || (fd = mkstemp(tmp)) == -1)
+		return NULL;
+	if(!(fp = fdopen(fd, "w"))) {
+		close(fd);
+		unlink(tmp);
+	}
+	return fp;
+}
+
+void
+packfill(Item *item, size_t p) {
+	char buf[sizeof text];
+
+	unpack(packid(p), buf);
+	free(item->text);
+	if(!(item->text = item->out = strdup(buf)))
+		eprintf("cannot malloc %u bytes:", strlen(buf) + 1);
+	item->score = 0;
+	item->left = (p > 0) ? packitem(p - 1) : NULL;
+	item->right = (p + 1 < nmatched) ? packitem(p + 1) : NULL;
+	packat[item - packitems] = p;
+	/* the Item may have been drawn as another match */
+	flushrows(item);
+}
+
+unsigned int
+packid(size_t p) {
+	int k;
+
+	/* positions run through the tiers in order */
+	for(k = 0; p >= npacktier[k]; k++)
+		p -= npacktier[k];
+	return packtier[k][p];
+}
+
+Item *
+packitem(size_t p) {
+	/* the ring holds 2 * packr + 1 positions, so those around curr never collide */
+	if(p == 0)
+		return &packitems[0];
+	if(p == nmatched - 1)
+		return &packitems[1];
+	return &packitems[2 + p % (2 * packr + 1)];
+}
+
+unsigned int
+packscore(unsigned int id) {
+	unsigned int lo = 0, hi = npackhot, mid;
+
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(packhot[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < npackhot && packhot[lo].id == id) ? packhot[lo].score : 0;
+}
+
+void
+packwindow(void) {
+	size_t c, p, lo, hi;
+	Item *item;
+
+	if(!curr)
+		return;
+	/* calcoffsets() and a step past either end of the page stay in here */
+	c = packat[curr - packitems];
+	lo = (c > packr) ? c - packr : 0;
+	hi = MIN(c + packr, nmatched - 1);
+	for(p = lo; p <= hi; p++)
+		if(packat[(item = packitem(p)) - packitems] != p)
+			packfill(item, p);
+}
+
 void
 paste(void) {
 	char *p, *q;
@@ -638,6 +1709,164 @@ paste(void) {
 	drawmenu();
 }
 
+void
+readcache(void) {
+	int fd;
+	unsigned int i, *off;
+	struct stat st;
+	CacheHeader *hdr;
+	char *map;
+
+	if((fd = open(cachefile, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+		eprintf("cannot open '%s':", cachefile);
+	if(st.st_size < (off_t)sizeof *hdr
+	|| (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		eprintf("cannot map '%s'\n", cachefile);
+	close(fd);
+	hdr = (CacheHeader *)map;
+	off = (unsigned int *)(hdr + 1);
+	if(memcmp(hdr->magic, CACHEMAGIC, sizeof hdr->magic)
+	|| (size_t)st.st_size < sizeof *hdr + (size_t)hdr->nitems * sizeof *off
+	                        + (size_t)hdr->strsize * ((hdr->flags & CacheFolded) ? 2 : 1)
+	|| (hdr->nitems && hdr->longest >= hdr->nitems))
+		eprintf("invalid item cache '%s'\n", cachefile);
+	cachestr = (char *)(off + hdr->nitems);
+	cachestrsize = hdr->strsize;
+	if(hdr->flags & CacheFolded && foldcase) {
+		/* the folded copy was made in the C locale, so it only serves
+		 * where the locale folds no bytes beyond ASCII either */
+		for(i = 128; i < 256 && tolower(i) == (int)i; i++);
+		if(i == 256)
+			cachefold = cachestr + cachestrsize;
+	}
+
+	/* the strings are used in place; only the list links need memory */
+	if(!(items = calloc(hdr->nitems + 1, sizeof *items)))
+		eprintf("cannot malloc %u bytes:", (hdr->nitems + 1) * sizeof *items);
+	for(i = 0; i < hdr->nitems; i++) {
+		if(off[i] >= cachestrsize)
+			eprintf("invalid item cache '%s'\n", cachefile);
+		items[i].text = items[i].out = (char *)&cachestr[off[i]];
+		items[i].score = histscore(items[i].text);
+	}
+	if(hdr->strsize && cachestr[hdr->strsize - 1] != '\0')
+		eprintf("invalid item cache '%s'\n", cachefile);
+	nitems = hdr->nitems;
+	itemsize = nitems + 1;
+	inputw = nitems ? textw(dc, items[hdr->longest].text) : 0;
+	if(ctlfd < 0) /* otherwise more items may follow */
+		lines = MIN(lines, nitems);
+}
+
+void
+readctl(void) {
+	static char buf[BUFSIZ];
+	static size_t len = 0;
+	static Bool discard = False; /* in a line too long to keep */
+	char *p, *q;
+	ssize_t n;
+	Bool damaged = False;
+	Item *item;
+
+	if((n = read(ctlfd, &buf[len], sizeof buf - 1 - len)) <= 0) {
+		if(n == -1 && errno == EINTR)
+			return;
+		/* the items stay as they are */
+		close(ctlfd);
+		ctlfd = -1;
+		return;
+	}
+	buf[len += n] = '\0';
+	p = buf;
+	if(discard) {
+		if(!(q = strchr(buf, '\n'))) {
+			len = 0;
+			return;
+		}
+		p = q + 1;
+		discard = False;
+	}
+	for(; (q = strchr(p, '\n')); p = q + 1) {
+		*q = '\0';
+		if(control(p))
+			damaged = True;
+	}
+	/* keep a partial line, unless it is too long ever to complete, in which
+	 * case the rest of it is dropped as it arrives */
+	if((len -= p - buf) == sizeof buf - 1) {
+		len = 0;
+		discard = True;
+	}
+	memmove(buf, p, len);
+
+	/* near misses depend on how many items match, so list them afresh */
+	if(maxtypos > 0 && !regex && tokc > 0 && (approxed || nmatched < MAX(lines, 1))) {
+		item = sel;
+		match();
+		if(item && (item == matches || item->left))
+			curr = sel = item;
+		damaged = True;
+	}
+	/* only redraw when the page or its arrows changed */
+	if(damaged) {
+		if(!curr)
+			curr = sel = matches;
+		calcoffsets();
+		drawmenu();
+	}
+}
+
+void
+readpacked(void) {
+	char buf[sizeof text], last[sizeof text], longest[sizeof text];
+	unsigned int i, score, hotsize = 0;
+	size_t len, n, max = 0, packlen = 0, size = 0, idxsize = 0;
+	char *p;
+
+	/* each item is stored as the length of the prefix it shares with the one
+	 * before, up to 255, and the rest of it; a block starts afresh */
+	last[0] = '\0';
+	for(i = 0; fgets(buf, sizeof buf, stdin); i++) {
+		if((p = strchr(buf, '\n')))
+			*p = '\0';
+		len = strlen(buf);
+		if(i % ZBLOCK == 0) {
+			if(i / ZBLOCK >= idxsize
+			&& !(packidx = realloc(packidx, (idxsize += BUFSIZ) * sizeof *packidx)))
+				eprintf("cannot realloc %u bytes:", idxsize * sizeof *packidx);
+			packidx[i / ZBLOCK] = packlen;
+			n = 0;
+		}
+		else
+			for(n = 0; n < 255 && buf[n] && buf[n] == last[n]; n++);
+		if(packlen + len - n + 2 > size) {
+			for(size = MAX(size, BUFSIZ); packlen + len - n + 2 > size; size *= 2);
+			if(!(pack = realloc(pack, size)))
+				eprintf("cannot realloc %u bytes:", size);
+		}
+		pack[packlen++] = n;
+		memcpy(&pack[packlen], &buf[n], len - n + 1);
+		packlen += len - n + 1;
+		memcpy(last, buf, len + 1);
+		if((score = histscore(buf))) {
+			if(npackhot == hotsize
+			&& !(packhot = realloc(packhot, (hotsize += 64) * sizeof *packhot)))
+				eprintf("cannot realloc %u bytes:", hotsize * sizeof *packhot);
+			packhot[npackhot].id = i;
+			packhot[npackhot++].score = score;
+		}
+		if(len > max) {
+			max = len;
+			memcpy(longest, buf, len + 1);
+		}
+	}
+	if(packlen && (p = realloc(pack, packlen)))
+		pack = p;
+	nitems = i;
+	inputw = max ? textw(dc, longest) : 0;
+	lines = MIN(lines, i);
+}
+
 void
 readstdin(void) {
 	char buf[sizeof text], *p, *maxstr = NULL;
@@ -650,22 +1879,56 @@ readstdin(void) {
 				eprintf("cannot realloc %u bytes:", size);
 		if((p = strchr(buf, '\n')))
 			*p = '\0';
-		if(!(items[i].text = strdup(buf)))
-			eprintf("cannot strdup %u bytes:", strlen(buf)+1);
+		setitem(&items[i], buf);
 		if(strlen(items[i].text) > max)
 			max = strlen(maxstr = items[i].text);
 	}
 	if(items)
 		items[i].text = NULL;
+	nitems = i;
+	itemsize = size / sizeof *items;
 	inputw = maxstr ? textw(dc, maxstr) : 0;
-	lines = MIN(lines, i);
+	if(ctlfd < 0) /* otherwise more items may follow */
+		lines = MIN(lines, i);
+}
+
+Bool
+renameaside(FILE *fp, const char *tmp, const char *file) {
+	Bool ok = !ferror(fp);
+	int err;
+
+	if(fclose(fp) == EOF || !ok || rename(tmp, file) == -1) {
+		err = errno;
+		unlink(tmp);
+		errno = err;
+		return False;
+	}
+	return True;
 }
 
 void
 run(void) {
 	XEvent ev;
+	fd_set fds;
+	int xfd = ConnectionNumber(dc->dpy);
 
-	while(running && !XNextEvent(dc->dpy, &ev)) {
+	while(running) {
+		/* wait for X and item updates alike, handling all queued events first */
+		if(ctlfd >= 0 && !XPending(dc->dpy)) {
+			FD_ZERO(&fds);
+			FD_SET(xfd, &fds);
+			FD_SET(ctlfd, &fds);
+			if(select(MAX(xfd, ctlfd) + 1, &fds, NULL, NULL, NULL) == -1) {
+				if(errno == EINTR)
+					continue;
+				eprintf("select failed:");
+			}
+			if(FD_ISSET(ctlfd, &fds))
+				readctl();
+			continue;
+		}
+		if(XNextEvent(dc->dpy, &ev))
+			break;
 		if(XFilterEvent(&ev, win))
 			continue;
 		switch(ev.type) {
@@ -694,19 +1957,84 @@ run(void) {
 	}
 }
 
+void
+savehistory(const char *s) {
+	char tmp[BUFSIZ];
+	unsigned int i, size, used = 0;
+	FILE *fp;
+	HistHeader hdr;
+	HistEntry *tab, *e;
+
+	if(!histfile)
+		return;
+	/* the selection is printed first, so the caller need not wait on the disk */
+	fflush(stdout);
+	for(i = 0; i < histsize; i++)
+		if(hist[i].hash)
+			used++;
+	/* keep the load factor at or below one half */
+	for(size = MAX(histsize, 64); (used + 1) * 2 > size; size *= 2);
+	if(!(tab = calloc(size, sizeof *tab)))
+		eprintf("cannot malloc %u bytes:", size * sizeof *tab);
+	for(i = 0; i < histsize; i++)
+		if(hist[i].hash)
+			*histlookup(tab, size, hist[i].hash) = hist[i];
+	e = histlookup(tab, size, histhash(s));
+	e->hash = histhash(s);
+	e->count++;
+	e->last = (unsigned int)time(NULL);
+
+	/* write a new store and rename it over the old one */
+	memcpy(hdr.magic, HISTMAGIC, sizeof hdr.magic);
+	hdr.size = size;
+	if((fp = openaside(histfile, tmp, sizeof tmp))) {
+		fwrite(&hdr, sizeof hdr, 1, fp);
+		fwrite(tab, sizeof *tab, size, fp);
+	}
+	if(!fp || !renameaside(fp, tmp, histfile))
+		fprintf(stderr, "dmenu: cannot write history '%s'\n", histfile);
+	free(tab);
+}
+
+void
+setitem(Item *item, const char *line) {
+	const char *m, *o;
+	size_t mlen, olen;
+
+	/* one copy holds the shown field, then the printed one if it differs */
+	m = field(line, mfield, &mlen);
+	o = field(line, ofield, &olen);
+	if(!(item->text = malloc(mlen + 1 + (mfield == ofield ? 0 : olen + 1))))
+		eprintf("cannot malloc %u bytes:", mlen + 1 + (mfield == ofield ? 0 : olen + 1));
+	memcpy(item->text, m, mlen);
+	item->text[mlen] = '\0';
+	if(mfield == ofield)
+		item->out = item->text;
+	else {
+		item->out = &item->text[mlen + 1];
+		memcpy(item->out, o, olen);
+		item->out[olen] = '\0';
+	}
+	item->score = histscore(item->out);
+}
+
 void
 setup(void) {
 	int x, y, screen = DefaultScreen(dc->dpy);
 	Window root = RootWindow(dc->dpy, screen);
 	XSetWindowAttributes swa;
 	XIM xim;
+	char *atomnames[] = { "CLIPBOARD", "UTF8_STRING" };
+	Atom atoms[LENGTH(atomnames)];
 #ifdef XINERAMA
 	int n;
 	XineramaScreenInfo *info;
 #endif
 
-	clip = XInternAtom(dc->dpy, "CLIPBOARD",   False);
-	utf8 = XInternAtom(dc->dpy, "UTF8_STRING", False);
+	/* both atoms in one round trip */
+	XInternAtoms(dc->dpy, atomnames, LENGTH(atomnames), False, atoms);
+	clip = atoms[0];
+	utf8 = atoms[1];
 
 	/* calculate menu geometry */
 	bh = (line_height > dc->font.height + 2) ? line_height : dc->font.height + 2;
@@ -716,8 +2044,9 @@ setup(void) {
 	if((info = XineramaQueryScreens(dc->dpy, &n))) {
 		int a, j, di, i = 0, area = 0;
 		unsigned int du;
+		unsigned int ww, wh, wb, wd;
+		int wx, wy;
 		Window w, pw, dw, *dws;
-		XWindowAttributes wa;
 
 		XGetInputFocus(dc->dpy, &w, &di);
 		if(w != root && w != PointerRoot && w != None) {
@@ -726,10 +2055,11 @@ setup(void) {
 				if(XQueryTree(dc->dpy, (pw = w), &dw, &w, &dws, &du) && dws)
 					XFree(dws);
 			} while(w != root && w != pw);
-			/* find xinerama screen with which the window intersects most */
-			if(XGetWindowAttributes(dc->dpy, pw, &wa))
+			/* find xinerama screen with which the window intersects most;
+			 * XGetGeometry takes one round trip, XGetWindowAttributes two */
+			if(XGetGeometry(dc->dpy, pw, &dw, &wx, &wy, &ww, &wh, &wb, &wd))
 				for(j = 0; j < n; j++)
-					if((a = INTERSECT(wa.x, wa.y, wa.width, wa.height, info[j])) > area) {
+					if((a = INTERSECT(wx, wy, (int)ww, (int)wh, info[j])) > area) {
 						area = a;
 						i = j;
 					}
@@ -756,6 +2086,17 @@ setup(void) {
 	x += xoffset;
 	mw = width ? width : mw;
 	inputw = MIN(inputw, mw/3);
+	if(lines > 0 && (!(rows = calloc(lines, sizeof *rows)) || !(page = calloc(lines, sizeof *page))))
+		eprintf("cannot malloc %u bytes:", lines * sizeof *rows);
+	if(packed) {
+		/* calcoffsets() visits no more than a page either side of curr and
+		 * each item takes at least the font height, or the whole page; one
+		 * more on each side is for stepping past the page */
+		packr = ((lines > 0) ? lines : mw / dc->font.height + 1) + 2;
+		if(!(packitems = calloc(2 * packr + 3, sizeof *packitems))
+		|| !(packat = malloc((2 * packr + 3) * sizeof *packat)))
+			eprintf("cannot malloc %u bytes:", (2 * packr + 3) * sizeof *packitems);
+	}
 	match();
 
 	/* create menu window */
@@ -778,9 +2119,190 @@ setup(void) {
 	drawmenu();
 }
 
+void
+tokenize(void) {
+	static char buf[sizeof text];
+	static int tokn = 0;
+	char *s;
+
+	strcpy(buf, text);
+	if(foldcase)
+		for(s = buf; *s; s++)
+			*s = tolower((unsigned char)*s);
+	/* separate input text into tokens to be matched individually */
+	for(tokc = 0, s = strtok(buf, " "); s; tokv[tokc-1] = s, s = strtok(NULL, " "))
+		if(++tokc > tokn && !(tokv = realloc(tokv, ++tokn * sizeof *tokv)))
+			eprintf("cannot realloc %u bytes\n", tokn * sizeof *tokv);
+	toklen = tokc ? strlen(tokv[0]) : 0;
+}
+
+unsigned int
+typos(const char *s) {
+	unsigned int d, sum;
+	int i;
+
+	/* the edits s needs to contain every token, or -1 if too many */
+	for(sum = 0, i = 0; i < tokc; i++) {
+		if(!maxerr[i])
+			d = fstrstr(s, tokv[i]) ? 0 : 1;
+		else
+			d = editdist(s, peq[i], toklens[i]);
+		if(d > maxerr[i])
+			return (unsigned int)-1;
+		sum += d;
+	}
+	return sum;
+}
+
+void
+typeahead(void) {
+	char c;
+	int len;
+	size_t n = strlen(text);
+	KeySym ksym;
+	XEvent ev;
+
+	/* typing queued while the items loaded goes straight into the text, so that
+	 * setup() matches once; the first other key and all after it are left
+	 * queued for keypress() */
+	while(XCheckTypedEvent(dc->dpy, KeyPress, &ev)) {
+		len = XLookupString(&ev.xkey, &c, 1, &ksym, NULL);
+		if(IsModifierKey(ksym))
+			continue;
+		if(ev.xkey.state & (ControlMask | Mod1Mask)) {
+			XPutBackEvent(dc->dpy, &ev);
+			break;
+		}
+		if(ksym == XK_BackSpace) {
+			while(n > 0 && (text[--n] & 0xc0) == 0x80);
+			text[n] = '\0';
+		}
+		else if(len == 1 && isprint((unsigned char)c) && !(c & 0x80)) {
+			if(n < sizeof text - 1) {
+				text[n++] = c;
+				text[n] = '\0';
+			}
+		}
+		else {
+			XPutBackEvent(dc->dpy, &ev);
+			break;
+		}
+	}
+	cursor = n;
+}
+
+Bool
+unlinkitem(Item *item) {
+	int i, s, t;
+	Bool damaged;
+
+	if(item != matches && !item->left)
+		return False; /* not listed */
+	damaged = onpage(item);
+	if((t = itemtier(item)) >= 0) {
+		s = item->score ? 2*t : 2*t+1;
+		if(tierend[s] == item) {
+			for(i = s - 1; i >= 0 && !tierend[i]; i--);
+			tierend[s] = (item->left && (i < 0 || item->left != tierend[i])) ? item->left : NULL;
+		}
+		nmatched--;
+	}
+	if(sel == item)
+		sel = item->right ? item->right : item->left;
+	if(curr == item)
+		curr = item->right ? item->right : item->left;
+	if(prev == item)
+		prev = item->right;
+	if(item->left)
+		item->left->right = item->right;
+	else
+		matches = item->right;
+	if(item->right)
+		item->right->left = item->left;
+	else
+		matchend = item->left;
+	item->left = item->right = NULL;
+	return damaged;
+}
+
+Bool
+widen(Item *item) {
+	int w;
+
+	/* the input field is as wide as the longest item allows, which moves the
+	 * whole horizontal list */
+	if(lines > 0 || inputw >= mw/3 || (w = textw(dc, item->text)) <= inputw)
+		return False;
+	inputw = MIN(w, mw/3);
+	return True;
+}
+
+int
+writecache(const char *file) {
+	char buf[BUFSIZ], tmp[BUFSIZ], *p, *strs = NULL;
+	unsigned int *off = NULL;
+	size_t i, n = 0, len, max = 0, strsize = 0, size = 0, offsize = 0;
+	FILE *fp;
+	CacheHeader hdr;
+
+	memset(&hdr, 0, sizeof hdr);
+	while(fgets(buf, sizeof buf, stdin)) {
+		if((p = strchr(buf, '\n')))
+			*p = '\0';
+		len = strlen(buf) + 1;
+		if(n + 1 > offsize && !(off = realloc(off, (offsize += BUFSIZ) * sizeof *off)))
+			eprintf("cannot realloc %u bytes:", offsize * sizeof *off);
+		if(strsize + len > size && !(strs = realloc(strs, (size = MAX(size * 2, BUFSIZ + len)))))
+			eprintf("cannot realloc %u bytes:", size);
+		if(strsize + len > (unsigned int)-1)
+			eprintf("too much input for an item cache\n");
+		memcpy(&strs[strsize], buf, len);
+		if(len - 1 > max) {
+			max = len - 1;
+			hdr.longest = n;
+		}
+		off[n++] = strsize;
+		strsize += len;
+	}
+	memcpy(hdr.magic, CACHEMAGIC, sizeof hdr.magic);
+	hdr.flags = CacheFolded;
+	hdr.nitems = n;
+	hdr.strsize = strsize;
+
+	if(!(fp = openaside(file, tmp, sizeof tmp)))
+		eprintf("cannot create '%s':", file);
+	fwrite(&hdr, sizeof hdr, 1, fp);
+	fwrite(off, sizeof *off, n, fp);
+	fwrite(strs, 1, strsize, fp);
+	/* no locale is set here, so only ASCII is folded */
+	for(i = 0; i < strsize; i++)
+		strs[i] = tolower((unsigned char)strs[i]);
+	fwrite(strs, 1, strsize, fp);
+	if(!renameaside(fp, tmp, file))
+		eprintf("cannot write '%s':", file);
+	free(off);
+	free(strs);
+	return EXIT_SUCCESS;
+}
+
+void
+unpack(unsigned int id, char *buf) {
+	const char *p = pack + packidx[id / ZBLOCK];
+	unsigned int i;
+	char *s;
+
+	for(i = id - id % ZBLOCK; ; i++) {
+		for(s = buf + (unsigned char)*p++; (*s++ = *p++); );
+		if(i == id)
+			return;
+	}
+}
+
 void
 usage(void) {
-	fputs("usage: dmenu [-b] [-f] [-i] [-l lines]\n"
+	fputs("usage: dmenu [-b] [-f] [-i] [-r] [-R] [-z] [-l lines] [-t typos] [-fn font]\n"
+	      "             [-c cachefile] [-H histfile] [-C cachefile] [-F query] [-u fd]\n"
+	      "             [-d delim] [-m field] [-o field]\n"
 	      "             [-x xoffset] [-y yoffset] [-h height] [-w width] [-v]\n", stderr);
 	exit(EXIT_FAILURE);
 }
@@ -808,6 +2330,10 @@ read_resources(void) {
 			selfgcolor = strdup(xvalue.addr);
 		if( selbgcolor == NULL && XrmGetResource(xdb, "dmenu.selbackground", "*", datatype, &xvalue) == True )
 			selbgcolor = strdup(xvalue.addr);
+		if( hifgcolor == NULL && XrmGetResource(xdb, "dmenu.highlightforeground", "*", datatype, &xvalue) == True )
+			hifgcolor = strdup(xvalue.addr);
+		if( hibgcolor == NULL && XrmGetResource(xdb, "dmenu.highlightbackground", "*", datatype, &xvalue) == True )
+			hibgcolor = strdup(xvalue.addr);
 		XrmDestroyDatabase(xdb);
 	}
 	/* Set default colors if they are not set */
@@ -819,4 +2345,106 @@ read_resources(void) {
 		selbgcolor  = "#0066ff";
 	if( selfgcolor == NULL )
 		selfgcolor  = "#ffffff";
+	if( hibgcolor == NULL )
+		hibgcolor = "#ffcc00";
+	if( hifgcolor == NULL )
+		hifgcolor = "#000000";
+}
+
+#ifdef BENCH
+/* Benchmark build (make bench): drawmenu() is timed from its first request
+ * until the server has processed the frame, and the session script given
+ * with -S is replayed through the ordinary event handlers. */
+void
+benchend(void) {
+	struct timespec now;
+	double ms;
+
+	nreqs += NextRequest(dc->dpy) - benchreq;
+	nexts += dc->nextents - benchext;
+	XSync(dc->dpy, False);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (now.tv_sec - benchts.tv_sec) * 1e3 + (now.tv_nsec - benchts.tv_nsec) / 1e6;
+	frametime += ms;
+	maxframetime = MAX(maxframetime, ms);
+	nframes++;
+}
+
+void
+benchkey(KeySym ksym) {
+	XEvent ev;
+
+	memset(&ev, 0, sizeof ev);
+	ev.xkey.type = KeyPress;
+	ev.xkey.display = dc->dpy;
+	ev.xkey.window = win;
+	ev.xkey.root = DefaultRootWindow(dc->dpy);
+	ev.xkey.same_screen = True;
+	if(!(ev.xkey.keycode = XKeysymToKeycode(dc->dpy, ksym)))
+		eprintf("bench: no keycode for keysym 0x%lx\n", ksym);
+	if(XLookupKeysym(&ev.xkey, 0) != ksym)
+		ev.xkey.state = ShiftMask;
+	keypress(&ev.xkey);
+}
+
+void
+benchstart(void) {
+	benchreq = NextRequest(dc->dpy);
+	benchext = dc->nextents;
+	clock_gettime(CLOCK_MONOTONIC, &benchts);
+}
+
+void
+replay(const char *file) {
+	char buf[BUFSIZ], cmd[32], arg[BUFSIZ], *p;
+	int i, n, pos;
+	FILE *fp;
+	KeySym ksym;
+	XEvent ev;
+
+	if(!(fp = fopen(file, "r")))
+		eprintf("cannot open '%s':", file);
+	/* the initial frame drawn by setup() is not part of the session */
+	nframes = nreqs = nexts = 0;
+	frametime = maxframetime = 0;
+	while(fgets(buf, sizeof buf, fp)) {
+		if((p = strchr(buf, '\n')))
+			*p = '\0';
+		n = 1;
+		if(buf[0] == '#' || sscanf(buf, "%31s", cmd) != 1)
+			continue;
+		if(!strcmp(cmd, "type")) {     /* type <text>: one keypress per byte */
+			for(p = buf + strlen("type"); *p == ' '; p++);
+			for(; *p; p++)
+				benchkey((KeySym)(unsigned char)*p);
+		}
+		else if(!strcmp(cmd, "key")) { /* key <keysym> [count] */
+			if(sscanf(buf, "%*s %1023s %d", arg, &n) < 1)
+				eprintf("bench: bad line '%s'\n", buf);
+			if((ksym = XStringToKeysym(arg)) == NoSymbol)
+				eprintf("bench: unknown keysym '%s'\n", arg);
+			for(i = 0; i < n; i++)
+				benchkey(ksym);
+		}
+		else if(!strcmp(cmd, "sweep")) { /* sweep [step]: pointer across the menu */
+			sscanf(buf, "%*s %d", &n);
+			memset(&ev, 0, sizeof ev);
+			ev.type = MotionNotify;
+			ev.xmotion.window = win;
+			for(pos = 0; pos < ((lines > 0) ? mh : mw); pos += MAX(n, 1)) {
+				ev.xmotion.x = (lines > 0) ? mw / 2 : pos;
+				ev.xmotion.y = (lines > 0) ? pos : bh / 2;
+				highlightmenu(&ev);
+			}
+		}
+		else
+			eprintf("bench: unknown command '%s'\n", cmd);
+	}
+	fclose(fp);
+	printf("%-8s %-10s frames %5lu  mean %7.3f ms  max %7.3f ms  requests/frame %7.1f  extents/frame %7.1f\n",
+	       dc->image ? "raster" : dc->font.xft_name ? "xft" : dc->font.set ? "fontset" : "core",
+	       (lines > 0) ? "vertical" : "horizontal", nframes,
+	       nframes ? frametime / nframes : 0, maxframetime,
+	       nframes ? (double)nreqs / nframes : 0, nframes ? (double)nexts / nframes : 0);
 }
+#endif
@@ -1,17 +1,102 @@
 /* See LICENSE file for copyright and license details. */
+#include <ctype.h>
 #include <locale.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
 #include <X11/Xlib.h>
 #include "draw.h"
 
 #define MAX(a, b)  ((a) > (b) ? (a) : (b))
 #define MIN(a, b)  ((a) < (b) ? (a) : (b))
+#define MAXFALLBACK 254  /* font indices must fit the coverage map */
+#define NPAGES      (0x110000 >> 8)
+#define NGLYPHS     1024 /* glyph cache buckets */
+#define FONTMAGIC   "DMF1"
+
+enum { FontCore, FontSet, FontXft }; /* font backends, in the order tried */
+
+struct GlyphImage {
+	XftFont *font;
+	FT_UInt index;
+	int x, y;    /* of the bitmap, relative to the pen on the baseline */
+	int w, h;
+	int advance;
+	unsigned char *bits; /* coverage, w * h bytes */
+	GlyphImage *next;
+};
+
+static unsigned long blend(unsigned long fg, unsigned long bg, int a);
+static void drawrun(DC *dc, int x, const char *text, size_t n, ColorSet *col);
+static Bool fontcache(const char *fontstr, char *path, size_t size);
+static int fontindex(DC *dc, FcChar32 c);
+static void fontkey(DC *dc, const char *fontstr, char *key, size_t size);
+static void freeimage(DC *dc);
+static GlyphImage *getglyph(DC *dc, XftFont *font, FcChar32 c);
+static Bool hexcolor(const char *colstr, XColor *color);
+static Bool loadcore(DC *dc, const char *fontstr);
+static Bool loadset(DC *dc, const char *fontstr);
+static Bool loadxft(DC *dc, const char *fontstr);
+static long mtime(const char *path);
+static Bool rasterimage(DC *dc, unsigned int w, unsigned int h);
+static void rasterrect(DC *dc, int x, int y, int w, int h, unsigned long color);
+static int rastertext(DC *dc, XftFont *font, int x, int y, const char *text, size_t n, unsigned long fg);
+static int readfontcache(DC *dc, const char *fontstr, const char *key);
+static int shmerror(Display *dpy, XErrorEvent *ee);
+static unsigned long truecolor(Visual *vis, XColor *color);
+static XftFont *xftfont(DC *dc, int i);
+static size_t xftrun(DC *dc, const char *text, size_t n, XftFont **font);
+static void writefontcache(DC *dc, const char *fontstr, const char *key, int backend);
+
+static Bool shmfailed;
+
+unsigned long
+blend(unsigned long fg, unsigned long bg, int a) {
+	unsigned long pixel = fg & ~0xffffffUL;
+	int shift;
+
+	for(shift = 0; shift < 24; shift += 8)
+		pixel |= (((fg >> shift & 0xff) * a + (bg >> shift & 0xff) * (255 - a)) / 255) << shift;
+	return pixel;
+}
+
+void
+copydc(DC *dc, int x, int y, unsigned int w, unsigned int h, int dx, int dy) {
+	unsigned int i, r;
+	int bpp;
+
+	if(dc->image) {
+		/* row by row, in the order that leaves the source intact */
+		bpp = dc->image->bits_per_pixel / 8;
+		for(i = 0; i < h; i++) {
+			r = (dy > y) ? h - 1 - i : i;
+			memmove(dc->image->data + (dy + r) * dc->image->bytes_per_line + dx * bpp,
+			        dc->image->data + (y + r) * dc->image->bytes_per_line + x * bpp, w * bpp);
+		}
+		return;
+	}
+	XCopyArea(dc->dpy, dc->canvas, dc->canvas, dc->gc, x, y, w, h, dx, dy);
+}
 
 void
 drawrect(DC *dc, int x, int y, unsigned int w, unsigned int h, Bool fill, unsigned long color) {
+	if(dc->image) {
+		if(fill)
+			rasterrect(dc, dc->x + x, dc->y + y, w, h, color);
+		else {
+			rasterrect(dc, dc->x + x, dc->y + y, w, 1, color);
+			rasterrect(dc, dc->x + x, dc->y + y + h - 1, w, 1, color);
+			rasterrect(dc, dc->x + x, dc->y + y, 1, h, color);
+			rasterrect(dc, dc->x + x + w - 1, dc->y + y, 1, h, color);
+		}
+		return;
+	}
 	XSetForeground(dc->dpy, dc->gc, color);
 	if(fill)
 		XFillRectangle(dc->dpy, dc->canvas, dc->gc, dc->x + x, dc->y + y, w, h);
@@ -20,39 +105,81 @@ drawrect(DC *dc, int x, int y, unsigned int w, unsigned int h, Bool fill, unsign
 }
 
 void
-drawtext(DC *dc, const char *text, ColorSet *col) {
+drawrun(DC *dc, int x, const char *text, size_t n, ColorSet *col) {
+	int y = dc->y + dc->font.ascent + (dc->h - dc->font.height)/2;
+	size_t len;
+	XftFont *f;
+	XGlyphInfo gi;
+
+	x += dc->x;
+	if(dc->image) {
+		for(; n > 0; text += len, n -= len) {
+			len = xftrun(dc, text, n, &f);
+			x = rastertext(dc, f, x, y, text, len, col->FG);
+		}
+		return;
+	}
+	XSetForeground(dc->dpy, dc->gc, col->FG);
+	if(dc->font.xft_name) {
+		if (!dc->xftdraw)
+			eprintf("error, xft drawable does not exist");
+		/* each run of text in one font, on a common baseline */
+		for(; n > 0; text += len, n -= len) {
+			len = xftrun(dc, text, n, &f);
+			XftDrawStringUtf8(dc->xftdraw, &col->FG_xft, f, x, y, (const FcChar8 *)text, len);
+			if(len < n) {
+				XftTextExtentsUtf8(dc->dpy, f, (const FcChar8 *)text, len, &gi);
+				x += gi.xOff;
+			}
+		}
+	} else if(dc->font.set) {
+		XmbDrawString(dc->dpy, dc->canvas, dc->font.set, dc->gc, x, y, text, n);
+	} else {
+		XSetFont(dc->dpy, dc->gc, dc->font.xfont->fid);
+		XDrawString(dc->dpy, dc->canvas, dc->gc, x, y, text, n);
+	}
+}
+
+void
+drawspans(DC *dc, const char *text, const Span *span, int nspan, ColorSet *col, ColorSet *hicol) {
 	char buf[BUFSIZ];
-	size_t mn, n = strlen(text);
+	size_t end, len, mn, off, n = strlen(text);
+	int i, w, x = dc->font.height/2;
 
 	/* shorten text if necessary */
 	for(mn = MIN(n, sizeof buf); textnw(dc, text, mn) + dc->font.height/2 > dc->w; mn--)
 		if(mn == 0)
 			return;
 	memcpy(buf, text, mn);
-	if(mn < n)
-		for(n = MAX(mn-3, 0); n < mn; buf[n++] = '.');
+	end = mn;
+	if(mn < n && mn >= 3)
+		for(n = end = mn-3; n < mn; buf[n++] = '.');
 
 	drawrect(dc, 0, 0, dc->w, dc->h, True, col->BG);
-	drawtextn(dc, buf, mn, col);
+	/* spans are sorted and disjoint; the dots are never highlighted */
+	for(off = 0, i = 0; i < nspan && span[i].off < end; i++) {
+		if(span[i].off > off) {
+			drawrun(dc, x, &buf[off], span[i].off - off, col);
+			x += textnw(dc, &buf[off], span[i].off - off);
+		}
+		len = MIN(span[i].off + span[i].len, end) - span[i].off;
+		w = textnw(dc, &buf[span[i].off], len);
+		drawrect(dc, x, 0, w, dc->h, True, hicol->BG);
+		drawrun(dc, x, &buf[span[i].off], len, hicol);
+		x += w;
+		off = span[i].off + len;
+	}
+	drawrun(dc, x, &buf[off], mn - off, col);
 }
 
 void
-drawtextn(DC *dc, const char *text, size_t n, ColorSet *col) {
-	int x = dc->x + dc->font.height/2;
-	int y = dc->y + dc->font.ascent + (dc->h - dc->font.height)/2;
+drawtext(DC *dc, const char *text, ColorSet *col) {
+	drawspans(dc, text, NULL, 0, col, NULL);
+}
 
-	XSetForeground(dc->dpy, dc->gc, col->FG);
-	if(dc->font.xft_font) {
-		if (!dc->xftdraw)
-			eprintf("error, xft drawable does not exist");
-		XftDrawStringUtf8(dc->xftdraw, &col->FG_xft,
-			dc->font.xft_font, x, y, (unsigned char*)text, n);
-	} else if(dc->font.set) {
-		XmbDrawString(dc->dpy, dc->canvas, dc->font.set, dc->gc, x, y, text, n);
-	} else {
-		XSetFont(dc->dpy, dc->gc, dc->font.xfont->fid);
-		XDrawString(dc->dpy, dc->canvas, dc->gc, x, y, text, n);
-	}
+void
+drawtextn(DC *dc, const char *text, size_t n, ColorSet *col) {
+	drawrun(dc, dc->font.height/2, text, n, col);
 }
 
 void
@@ -70,6 +197,82 @@ eprintf(const char *fmt, ...) {
 	exit(EXIT_FAILURE);
 }
 
+Bool
+fontcache(const char *fontstr, char *path, size_t size) {
+	const char *dir, *home = getenv("HOME");
+	unsigned int h = 2166136261U;
+	int n;
+
+	/* one file per font string, in dmenu_path's cache directory */
+	for(; *fontstr; fontstr++)
+		h = (h ^ (unsigned char)*fontstr) * 16777619U;
+	if((dir = getenv("XDG_CACHE_HOME")) && *dir)
+		n = snprintf(path, size, "%s/dmenu_font_%08x", dir, h);
+	else if(home)
+		n = snprintf(path, size, "%s/.cache/dmenu_font_%08x", home, h);
+	else
+		return False;
+	return n > 0 && (size_t)n < size;
+}
+
+int
+fontindex(DC *dc, FcChar32 c) {
+	FcCharSet *cs;
+	FcResult result;
+	unsigned char *page;
+	int i, j, n;
+
+	if(c >= 0x110000)
+		return 0;
+	if(!dc->font.xft_cover && !(dc->font.xft_cover = calloc(NPAGES, sizeof *dc->font.xft_cover)))
+		eprintf("cannot malloc %u bytes:", NPAGES * sizeof *dc->font.xft_cover);
+	if(!(page = dc->font.xft_cover[c >> 8]) && !(page = dc->font.xft_cover[c >> 8] = calloc(256, 1)))
+		eprintf("cannot malloc %u bytes:", 256);
+	if(page[c & 0xff])
+		return page[c & 0xff] - 1;
+
+	/* the first font covering c, or the primary font to draw the box */
+	i = 0;
+	if(!XftCharExists(dc->dpy, xftfont(dc, 0), c)) {
+		if(!dc->font.xft_set) {
+			/* fallbacks are sorted against the substituted request */
+			if((dc->font.xft_pattern = FcNameParse((const FcChar8 *)dc->font.xft_name))) {
+				FcConfigSubstitute(NULL, dc->font.xft_pattern, FcMatchPattern);
+				XftDefaultSubstitute(dc->dpy, DefaultScreen(dc->dpy), dc->font.xft_pattern);
+			}
+			dc->font.xft_set = FcFontSort(NULL, dc->font.xft_pattern, FcTrue, NULL, &result);
+			if(!dc->font.xft_set && !(dc->font.xft_set = FcFontSetCreate()))
+				eprintf("cannot create font set\n");
+			if(!(dc->font.xft_fallback = calloc(dc->font.xft_set->nfont + 1, sizeof *dc->font.xft_fallback)))
+				eprintf("cannot malloc %u bytes:", (dc->font.xft_set->nfont + 1) * sizeof *dc->font.xft_fallback);
+		}
+		n = MIN(dc->font.xft_set->nfont, MAXFALLBACK);
+		for(j = 0; j < n; j++)
+			if(FcPatternGetCharSet(dc->font.xft_set->fonts[j], FC_CHARSET, 0, &cs) == FcResultMatch
+			&& FcCharSetHasChar(cs, c))
+				break;
+		i = (j < n) ? j + 1 : 0;
+	}
+	page[c & 0xff] = i + 1;
+	return i;
+}
+
+void
+fontkey(DC *dc, const char *fontstr, char *key, size_t size) {
+	char conf[PATH_MAX];
+	const char *dir, *dpi = XGetDefault(dc->dpy, "Xft", "dpi");
+	int screen = DefaultScreen(dc->dpy);
+
+	/* a font resolves alike while its configuration and the screen do */
+	if((dir = getenv("XDG_CONFIG_HOME")) && *dir)
+		snprintf(conf, sizeof conf, "%s/fontconfig/fonts.conf", dir);
+	else
+		snprintf(conf, sizeof conf, "%s/.config/fontconfig/fonts.conf", getenv("HOME") ? getenv("HOME") : "");
+	snprintf(key, size, "%s\t%ld %ld %ld %d %d %s", fontstr,
+	         mtime("/etc/fonts/fonts.conf"), mtime("/etc/fonts/conf.d"), mtime(conf),
+	         DisplayWidth(dc->dpy, screen), DisplayWidthMM(dc->dpy, screen), dpi ? dpi : "-");
+}
+
 void
 freecol(DC *dc, ColorSet *col) {
     if(col) {
@@ -82,10 +285,39 @@ freecol(DC *dc, ColorSet *col) {
 
 void
 freedc(DC *dc) {
-    if(dc->font.xft_font) {
-        XftFontClose(dc->dpy, dc->font.xft_font);
-        XftDrawDestroy(dc->xftdraw);
-    }
+	GlyphImage *g, *next;
+	int i;
+
+	freeimage(dc);
+	if(dc->glyphs) {
+		for(i = 0; i < NGLYPHS; i++)
+			for(g = dc->glyphs[i]; g; g = next) {
+				next = g->next;
+				free(g->bits);
+				free(g);
+			}
+		free(dc->glyphs);
+	}
+	if(dc->font.xft_set) {
+		for(i = 0; i < dc->font.xft_set->nfont; i++)
+			if(dc->font.xft_fallback[i + 1] && dc->font.xft_fallback[i + 1] != dc->font.xft_font)
+				XftFontClose(dc->dpy, dc->font.xft_fallback[i + 1]);
+		free(dc->font.xft_fallback);
+		FcFontSetDestroy(dc->font.xft_set);
+	}
+	if(dc->font.xft_cover) {
+		for(i = 0; i < NPAGES; i++)
+			free(dc->font.xft_cover[i]);
+		free(dc->font.xft_cover);
+	}
+	if(dc->font.xft_pattern)
+		FcPatternDestroy(dc->font.xft_pattern);
+	if(dc->font.xft_font)
+		XftFontClose(dc->dpy, dc->font.xft_font);
+	if(dc->xftdraw)
+		XftDrawDestroy(dc->xftdraw);
+	free(dc->font.xft_name);
+	free(dc->font.xft_match);
 	if(dc->font.set)
 		XFreeFontSet(dc->dpy, dc->font.set);
     if(dc->font.xfont)
@@ -100,27 +332,123 @@ freedc(DC *dc) {
         free(dc);
 }
 
+void
+freeimage(DC *dc) {
+	if(!dc->image)
+		return;
+	if(dc->shm.shmid != -1) {
+		XShmDetach(dc->dpy, &dc->shm);
+		shmdt(dc->shm.shmaddr);
+		dc->image->data = NULL;
+	}
+	XDestroyImage(dc->image);
+	dc->image = NULL;
+}
+
 unsigned long
 getcolor(DC *dc, const char *colstr) {
 	Colormap cmap = DefaultColormap(dc->dpy, DefaultScreen(dc->dpy));
+	Visual *vis = DefaultVisual(dc->dpy, DefaultScreen(dc->dpy));
 	XColor color;
 
+	/* a TrueColor pixel can be composed locally, saving a round trip */
+	if(vis->class == TrueColor && hexcolor(colstr, &color))
+		return truecolor(vis, &color);
 	if(!XAllocNamedColor(dc->dpy, cmap, colstr, &color, &color))
 		eprintf("cannot allocate color '%s'\n", colstr);
 	return color.pixel;
 }
 
+GlyphImage *
+getglyph(DC *dc, XftFont *font, FcChar32 c) {
+	FT_UInt index = XftCharIndex(dc->dpy, font, c);
+	unsigned int h = ((unsigned long)font / sizeof(void *) * 31 + index) % NGLYPHS;
+	FT_Bitmap *bm;
+	FT_Face face;
+	GlyphImage *g;
+	XGlyphInfo gi;
+	int i, j;
+
+	if(!dc->glyphs && !(dc->glyphs = calloc(NGLYPHS, sizeof *dc->glyphs)))
+		eprintf("cannot malloc %u bytes:", NGLYPHS * sizeof *dc->glyphs);
+	for(g = dc->glyphs[h]; g; g = g->next)
+		if(g->font == font && g->index == index)
+			return g;
+	if(!(g = calloc(1, sizeof *g)))
+		eprintf("cannot malloc %u bytes:", sizeof *g);
+	g->font = font;
+	g->index = index;
+	/* advance as Xft measures it, so drawing agrees with textnw() */
+	XftGlyphExtents(dc->dpy, font, &index, 1, &gi);
+	g->advance = gi.xOff;
+	if((face = XftLockFace(font))) {
+		bm = &face->glyph->bitmap;
+		if(!FT_Load_Glyph(face, index, FT_LOAD_DEFAULT | FT_LOAD_RENDER)
+		&& (bm->pixel_mode == FT_PIXEL_MODE_GRAY || bm->pixel_mode == FT_PIXEL_MODE_MONO)
+		&& bm->pitch >= 0) {
+			g->x = face->glyph->bitmap_left;
+			g->y = -face->glyph->bitmap_top;
+			g->w = bm->width;
+			g->h = bm->rows;
+			if(!(g->bits = malloc(g->w * g->h + 1)))
+				eprintf("cannot malloc %u bytes:", g->w * g->h + 1);
+			for(i = 0; i < g->h; i++)
+				for(j = 0; j < g->w; j++)
+					g->bits[i * g->w + j] = (bm->pixel_mode == FT_PIXEL_MODE_MONO)
+						? ((bm->buffer[i * bm->pitch + j / 8] >> (7 - j % 8) & 1) ? 255 : 0)
+						: bm->buffer[i * bm->pitch + j];
+		}
+		XftUnlockFace(font);
+	}
+	g->next = dc->glyphs[h];
+	dc->glyphs[h] = g;
+	return g;
+}
+
+Bool
+hexcolor(const char *colstr, XColor *color) {
+	unsigned long v;
+	int i;
+
+	if(colstr[0] != '#' || strlen(colstr) != 7)
+		return False;
+	for(i = 1; i < 7; i++)
+		if(!isxdigit((unsigned char)colstr[i]))
+			return False;
+	v = strtoul(&colstr[1], NULL, 16);
+	color->red   = ((v >> 16) & 0xff) * 0x101;
+	color->green = ((v >> 8) & 0xff) * 0x101;
+	color->blue  = (v & 0xff) * 0x101;
+	return True;
+}
+
 ColorSet *
 initcolor(DC *dc, const char * foreground, const char * background) {
 	ColorSet * col = (ColorSet *)malloc(sizeof(ColorSet));
+	XColor color;
+	XRenderColor rc;
+	Bool ok;
+
 	if(!col)
 		eprintf("error, cannot allocate memory for color set");
 	col->BG = getcolor(dc, background);
 	col->FG = getcolor(dc, foreground);
-	if(dc->font.xft_font)
-		if(!XftColorAllocName(dc->dpy, DefaultVisual(dc->dpy, DefaultScreen(dc->dpy)),
-			DefaultColormap(dc->dpy, DefaultScreen(dc->dpy)), foreground, &col->FG_xft))
+	if(dc->font.xft_name) {
+		/* XftColorAllocValue needs no round trip on TrueColor visuals */
+		if(hexcolor(foreground, &color)) {
+			rc.red = color.red;
+			rc.green = color.green;
+			rc.blue = color.blue;
+			rc.alpha = 0xffff;
+			ok = XftColorAllocValue(dc->dpy, DefaultVisual(dc->dpy, DefaultScreen(dc->dpy)),
+				DefaultColormap(dc->dpy, DefaultScreen(dc->dpy)), &rc, &col->FG_xft);
+		}
+		else
+			ok = XftColorAllocName(dc->dpy, DefaultVisual(dc->dpy, DefaultScreen(dc->dpy)),
+				DefaultColormap(dc->dpy, DefaultScreen(dc->dpy)), foreground, &col->FG_xft);
+		if(!ok)
 			eprintf("error, cannot allocate xft font color '%s'\n", foreground);
+	}
 	return col;
 }
 
@@ -142,51 +470,268 @@ initdc(void) {
 
 void
 initfont(DC *dc, const char *fontstr) {
-	char *def, **missing, **names;
+	char key[BUFSIZ];
+	int backend;
+	Bool cached, xlfd;
+
+	/* the cache names the backend that resolved, so the probes failing
+	 * before it can be skipped; an Xft font is then opened on first use.
+	 * A logical font description or the server's fixed alias is for X
+	 * itself, so the cache is not consulted for it */
+	xlfd = fontstr[0] == '-' || strchr(fontstr, '*') || !strcmp(fontstr, "fixed");
+	if(!xlfd) {
+		fontkey(dc, fontstr, key, sizeof key);
+		backend = readfontcache(dc, fontstr, key);
+	}
+	cached = !xlfd && (backend == FontXft || (backend == FontSet && loadset(dc, fontstr)));
+	if(cached)
+		;
+	else if(loadcore(dc, fontstr))
+		backend = FontCore;
+	else if(loadset(dc, fontstr))
+		backend = FontSet;
+	else if(loadxft(dc, fontstr))
+		backend = FontXft;
+	else
+		eprintf("cannot load font '%s'\n", fontstr);
+	dc->font.height = dc->font.ascent + dc->font.descent;
+	if(!cached && !xlfd && backend != FontCore)
+		writefontcache(dc, fontstr, key, backend);
+}
+
+Bool
+loadcore(DC *dc, const char *fontstr) {
+	if(!(dc->font.xfont = XLoadQueryFont(dc->dpy, fontstr)))
+		return False;
+	dc->font.ascent = dc->font.xfont->ascent;
+	dc->font.descent = dc->font.xfont->descent;
+	dc->font.width   = dc->font.xfont->max_bounds.width;
+	return True;
+}
+
+Bool
+loadset(DC *dc, const char *fontstr) {
+	char *def, **missing = NULL, **names;
 	int i, n;
 	XFontStruct **xfonts;
 
-	missing = NULL;
-	if((dc->font.xfont = XLoadQueryFont(dc->dpy, fontstr))) {
-		dc->font.ascent = dc->font.xfont->ascent;
-		dc->font.descent = dc->font.xfont->descent;
-		dc->font.width   = dc->font.xfont->max_bounds.width;
-	} else if((dc->font.set = XCreateFontSet(dc->dpy, fontstr, &missing, &n, &def))) {
-		n = XFontsOfFontSet(dc->font.set, &xfonts, &names);
-		for(i = 0; i < n; i++) {
-			dc->font.ascent  = MAX(dc->font.ascent,  xfonts[i]->ascent);
-			dc->font.descent = MAX(dc->font.descent, xfonts[i]->descent);
-			dc->font.width   = MAX(dc->font.width,   xfonts[i]->max_bounds.width);
-		}
-	} else if((dc->font.xft_font = XftFontOpenName(dc->dpy, DefaultScreen(dc->dpy), fontstr))) {
-		dc->font.ascent = dc->font.xft_font->ascent;
-		dc->font.descent = dc->font.xft_font->descent;
-		dc->font.width = dc->font.xft_font->max_advance_width;
-	} else {
-		eprintf("cannot load font '%s'\n", fontstr);
-	}
+	dc->font.set = XCreateFontSet(dc->dpy, fontstr, &missing, &n, &def);
 	if(missing)
 		XFreeStringList(missing);
-	dc->font.height = dc->font.ascent + dc->font.descent;
-	return;
+	if(!dc->font.set)
+		return False;
+	n = XFontsOfFontSet(dc->font.set, &xfonts, &names);
+	for(i = 0; i < n; i++) {
+		dc->font.ascent  = MAX(dc->font.ascent,  xfonts[i]->ascent);
+		dc->font.descent = MAX(dc->font.descent, xfonts[i]->descent);
+		dc->font.width   = MAX(dc->font.width,   xfonts[i]->max_bounds.width);
+	}
+	return True;
+}
+
+Bool
+loadxft(DC *dc, const char *fontstr) {
+	XGlyphInfo gi;
+	FcChar8 c;
+
+	if(!(dc->font.xft_font = XftFontOpenName(dc->dpy, DefaultScreen(dc->dpy), fontstr)))
+		return False;
+	if(!(dc->font.xft_name = strdup(fontstr)))
+		eprintf("cannot strdup %u bytes:", strlen(fontstr) + 1);
+	dc->font.ascent = dc->font.xft_font->ascent;
+	dc->font.descent = dc->font.xft_font->descent;
+	dc->font.width = dc->font.xft_font->max_advance_width;
+	for(c = ' '; c <= '~'; c++)
+		if(XftCharExists(dc->dpy, dc->font.xft_font, c)) {
+			XftTextExtents8(dc->dpy, dc->font.xft_font, &c, 1, &gi);
+			dc->font.xft_advance[c - ' '] = gi.xOff;
+		}
+		else
+			dc->font.xft_advance[c - ' '] = -1;
+	dc->font.xft_hasadvance = True;
+	return True;
+}
+
+long
+mtime(const char *path) {
+	struct stat st;
+
+	return (stat(path, &st) == -1) ? -1 : (long)st.st_mtime;
 }
 
 void
 mapdc(DC *dc, Window win, unsigned int w, unsigned int h) {
+	if(dc->image) {
+		if(dc->shm.shmid != -1) {
+			XShmPutImage(dc->dpy, win, dc->gc, dc->image, 0, 0, 0, 0, w, h, False);
+			/* the server reads the segment later; keep it until then */
+			XSync(dc->dpy, False);
+		}
+		else
+			XPutImage(dc->dpy, win, dc->gc, dc->image, 0, 0, 0, 0, w, h);
+		return;
+	}
 	XCopyArea(dc->dpy, dc->canvas, win, dc->gc, 0, 0, w, h, 0, 0);
 }
 
+Bool
+rasterimage(DC *dc, unsigned int w, unsigned int h) {
+	int screen = DefaultScreen(dc->dpy);
+	int depth = DefaultDepth(dc->dpy, screen);
+	Visual *vis = DefaultVisual(dc->dpy, screen);
+	XErrorHandler handler;
+	char *data;
+
+	/* glyphs come from Xft fonts and are blended in 8-bit channels */
+	if(!dc->font.xft_name || vis->class != TrueColor || (depth != 24 && depth != 32)
+	|| vis->red_mask != 0xff0000 || vis->green_mask != 0xff00 || vis->blue_mask != 0xff)
+		return False;
+	freeimage(dc);
+	dc->shm.shmid = -1;
+	if(XShmQueryExtension(dc->dpy)
+	&& (dc->image = XShmCreateImage(dc->dpy, vis, depth, ZPixmap, NULL, &dc->shm, w, h))) {
+		if(dc->image->bits_per_pixel == 32
+		&& (dc->shm.shmid = shmget(IPC_PRIVATE, dc->image->bytes_per_line * h, IPC_CREAT | 0600)) != -1) {
+			dc->shm.shmaddr = dc->image->data = shmat(dc->shm.shmid, NULL, 0);
+			dc->shm.readOnly = False;
+			/* a remote server fails to attach, asynchronously */
+			shmfailed = (dc->shm.shmaddr == (char *)-1);
+			if(!shmfailed) {
+				handler = XSetErrorHandler(shmerror);
+				XShmAttach(dc->dpy, &dc->shm);
+				XSync(dc->dpy, False);
+				XSetErrorHandler(handler);
+			}
+			/* the segment goes once both sides have detached */
+			shmctl(dc->shm.shmid, IPC_RMID, NULL);
+			if(shmfailed) {
+				if(dc->shm.shmaddr != (char *)-1)
+					shmdt(dc->shm.shmaddr);
+				dc->shm.shmid = -1;
+			}
+		}
+		if(dc->shm.shmid == -1) {
+			dc->image->data = NULL;
+			XDestroyImage(dc->image);
+			dc->image = NULL;
+		}
+	}
+	if(!dc->image) {
+		if(!(dc->image = XCreateImage(dc->dpy, vis, depth, ZPixmap, 0, NULL, w, h, 32, 0)))
+			return False;
+		if(dc->image->bits_per_pixel != 32 || !(data = malloc(dc->image->bytes_per_line * h))) {
+			XDestroyImage(dc->image);
+			dc->image = NULL;
+			return False;
+		}
+		dc->image->data = data;
+	}
+	return True;
+}
+
+void
+rasterrect(DC *dc, int x, int y, int w, int h, unsigned long color) {
+	int i, j, x1 = MIN(x + w, dc->image->width), y1 = MIN(y + h, dc->image->height);
+	unsigned int *row;
+
+	for(i = MAX(y, 0); i < y1; i++) {
+		row = (unsigned int *)(dc->image->data + i * dc->image->bytes_per_line);
+		for(j = MAX(x, 0); j < x1; j++)
+			row[j] = color;
+	}
+}
+
+int
+rastertext(DC *dc, XftFont *font, int x, int y, const char *text, size_t n, unsigned long fg) {
+	FcChar32 c;
+	GlyphImage *g;
+	unsigned int *row;
+	int a, i, j, k, px, py;
+
+	for(; n > 0; text += k, n -= k) {
+		if((k = FcUtf8ToUcs4((const FcChar8 *)text, &c, n)) <= 0) {
+			k = 1;
+			c = 0;
+		}
+		g = getglyph(dc, font, c);
+		for(i = 0; i < g->h; i++) {
+			if((py = y + g->y + i) < 0 || py >= dc->image->height)
+				continue;
+			row = (unsigned int *)(dc->image->data + py * dc->image->bytes_per_line);
+			for(j = 0; j < g->w; j++) {
+				px = x + g->x + j;
+				if(px < 0 || px >= dc->image->width || !(a = g->bits[i * g->w + j]))
+					continue;
+				row[px] = (a == 255) ? fg : blend(fg, row[px], a);
+			}
+		}
+		x += g->advance;
+	}
+	return x;
+}
+
+int
+readfontcache(DC *dc, const char *fontstr, const char *key) {
+	char path[PATH_MAX], *file = NULL, *line = NULL;
+	size_t size = 0, fsize = 0;
+	ssize_t len;
+	int backend, i;
+	long t;
+	FILE *fp;
+
+	if(!fontcache(fontstr, path, sizeof path) || !(fp = fopen(path, "r")))
+		return -1;
+	/* magic, key and backend; an Xft entry adds its metrics, the advances,
+	 * its font file and modification time, and the match as fontconfig names it */
+	if(getline(&line, &size, fp) == -1 || strcmp(line, FONTMAGIC "\n")
+	|| getline(&line, &size, fp) == -1 || strncmp(line, key, strlen(key)) || line[strlen(key)] != '\n'
+	|| fscanf(fp, "%d", &backend) != 1)
+		backend = -1;
+	else if(backend == FontXft) {
+		if(fscanf(fp, "%d %d %d", &dc->font.ascent, &dc->font.descent, &dc->font.width) != 3)
+			backend = -1;
+		for(i = 0; backend != -1 && i <= '~' - ' '; i++)
+			if(fscanf(fp, "%d", &dc->font.xft_advance[i]) != 1)
+				backend = -1;
+		if(backend != -1 && getline(&line, &size, fp) != -1
+		&& (len = getline(&file, &fsize, fp)) > 1 && fscanf(fp, "%ld", &t) == 1
+		&& getline(&line, &size, fp) != -1
+		&& (file[len - 1] = '\0', mtime(file) == t)
+		&& (len = getline(&line, &size, fp)) > 1 && line[len - 1] == '\n') {
+			line[len - 1] = '\0';
+			if(!(dc->font.xft_match = strdup(line)) || !(dc->font.xft_name = strdup(fontstr)))
+				eprintf("cannot strdup %u bytes:", len);
+			dc->font.xft_hasadvance = True;
+		}
+		else
+			backend = -1;
+	}
+	else if(backend != FontSet)
+		backend = -1;
+	if(backend != FontXft) /* leave nothing half read */
+		dc->font.ascent = dc->font.descent = dc->font.width = 0;
+	free(file);
+	free(line);
+	fclose(fp);
+	return backend;
+}
+
 void
 resizedc(DC *dc, unsigned int w, unsigned int h) {
 	int screen = DefaultScreen(dc->dpy);
-	if(dc->canvas)
-		XFreePixmap(dc->dpy, dc->canvas);
 
 	dc->w = w;
 	dc->h = h;
+	if(dc->raster) {
+		if(rasterimage(dc, w, h))
+			return;
+		dc->raster = False; /* draw on the server after all */
+	}
+	if(dc->canvas)
+		XFreePixmap(dc->dpy, dc->canvas);
 	dc->canvas = XCreatePixmap(dc->dpy, DefaultRootWindow(dc->dpy), w, h,
 	                           DefaultDepth(dc->dpy, screen));
-	if(dc->font.xft_font && !(dc->xftdraw)) {
+	if(dc->font.xft_name && !(dc->xftdraw)) {
 		dc->xftdraw = XftDrawCreate(dc->dpy, dc->canvas, DefaultVisual(dc->dpy,screen), DefaultColormap(dc->dpy,screen));
 		if(!(dc->xftdraw))
 			eprintf("error, cannot create xft drawable\n");
@@ -195,10 +740,32 @@ resizedc(DC *dc, unsigned int w, unsigned int h) {
 
 int
 textnw(DC *dc, const char *text, size_t len) {
-	if(dc->font.xft_font) {
+#ifdef BENCH
+	dc->nextents++;
+#endif
+	if(dc->font.xft_name) {
 		XGlyphInfo gi;
-		XftTextExtentsUtf8(dc->dpy, dc->font.xft_font, (const FcChar8*)text, len, &gi);
-		return gi.width;
+		XftFont *f;
+		size_t i, n;
+		int a, w;
+
+		/* printable ASCII is measured from the table, without the font */
+		if(dc->font.xft_hasadvance) {
+			for(w = 0, i = 0; i < len; i++) {
+				if(text[i] < ' ' || text[i] > '~' || (a = dc->font.xft_advance[text[i] - ' ']) < 0)
+					break;
+				w += a;
+			}
+			if(i == len)
+				return w;
+		}
+		/* by advance, so that widths add up as runs and table lookups do */
+		for(w = 0; len > 0; text += n, len -= n) {
+			n = xftrun(dc, text, len, &f);
+			XftTextExtentsUtf8(dc->dpy, f, (const FcChar8*)text, n, &gi);
+			w += gi.xOff;
+		}
+		return w;
 	} else if(dc->font.set) {
 		XRectangle r;
 		XmbTextExtents(dc->font.set, text, len, NULL, &r);
@@ -207,6 +774,122 @@ textnw(DC *dc, const char *text, size_t len) {
 	return XTextWidth(dc->font.xfont, text, len);
 }
 
+int
+shmerror(Display *dpy, XErrorEvent *ee) {
+	shmfailed = True;
+	return 0;
+}
+
+unsigned long
+truecolor(Visual *vis, XColor *color) {
+	unsigned long mask[3], pixel = 0;
+	unsigned short v[3];
+	int i, shift, bits;
+
+	mask[0] = vis->red_mask;
+	mask[1] = vis->green_mask;
+	mask[2] = vis->blue_mask;
+	v[0] = color->red;
+	v[1] = color->green;
+	v[2] = color->blue;
+	/* keep the top bits of each 16-bit channel, as the server does */
+	for(i = 0; i < 3; i++) {
+		for(shift = 0; shift < 32 && !(mask[i] >> shift & 1); shift++);
+		for(bits = 0; shift + bits < 32 && mask[i] >> (shift + bits) & 1; bits++);
+		if(bits > 0 && bits <= 16)
+			pixel |= (unsigned long)(v[i] >> (16 - bits)) << shift;
+	}
+	return pixel;
+}
+
+XftFont *
+xftfont(DC *dc, int i) {
+	FcPattern *pat;
+
+	if(i == 0) {
+		if(dc->font.xft_font)
+			return dc->font.xft_font;
+		/* the cached match skips fontconfig's search */
+		if(dc->font.xft_match && (pat = FcNameParse((const FcChar8 *)dc->font.xft_match))
+		&& !(dc->font.xft_font = XftFontOpenPattern(dc->dpy, pat)))
+			FcPatternDestroy(pat);
+		if(!dc->font.xft_font
+		&& !(dc->font.xft_font = XftFontOpenName(dc->dpy, DefaultScreen(dc->dpy), dc->font.xft_name)))
+			eprintf("cannot load font '%s'\n", dc->font.xft_name);
+		return dc->font.xft_font;
+	}
+	if(!dc->font.xft_fallback[i]) {
+		/* a font that will not open falls back to the primary one for good */
+		if(!(pat = FcFontRenderPrepare(NULL, dc->font.xft_pattern, dc->font.xft_set->fonts[i - 1])))
+			return xftfont(dc, 0);
+		if(!(dc->font.xft_fallback[i] = XftFontOpenPattern(dc->dpy, pat))) {
+			FcPatternDestroy(pat);
+			dc->font.xft_fallback[i] = xftfont(dc, 0);
+		}
+	}
+	return dc->font.xft_fallback[i];
+}
+
+size_t
+xftrun(DC *dc, const char *text, size_t n, XftFont **font) {
+	FcChar32 c;
+	size_t len;
+	int i = -1, j, k;
+
+	/* the longest prefix of text drawn in a single font */
+	for(len = 0; len < n; len += k) {
+		if((k = FcUtf8ToUcs4((const FcChar8 *)&text[len], &c, n - len)) <= 0) {
+			k = 1; /* invalid bytes go to the primary font */
+			c = 0;
+		}
+		j = fontindex(dc, c);
+		if(i == -1)
+			i = j;
+		else if(j != i)
+			break;
+	}
+	*font = xftfont(dc, i);
+	return len;
+}
+
+void
+writefontcache(DC *dc, const char *fontstr, const char *key, int backend) {
+	char path[PATH_MAX], tmp[PATH_MAX];
+	FcChar8 *file, *match = NULL;
+	int fd, i;
+	Bool ok;
+	FILE *fp;
+
+	if(backend == FontXft
+	&& (FcPatternGetString(dc->font.xft_font->pattern, FC_FILE, 0, &file) != FcResultMatch
+	    || !(match = FcNameUnparse(dc->font.xft_font->pattern))))
+		return;
+	/* written aside and renamed into place, as nothing waits on it */
+	if(!fontcache(fontstr, path, sizeof path)
+	|| (size_t)snprintf(tmp, sizeof tmp, "%s.XXXXXX", path) >= sizeof tmp
+	|| (fd = mkstemp(tmp)) == -1) {
+		free(match);
+		return;
+	}
+	if(!(fp = fdopen(fd, "w"))) {
+		close(fd);
+		unlink(tmp);
+		free(match);
+		return;
+	}
+	fprintf(fp, "%s\n%s\n%d\n", FONTMAGIC, key, backend);
+	if(backend == FontXft) {
+		fprintf(fp, "%d %d %d\n", dc->font.ascent, dc->font.descent, dc->font.width);
+		for(i = 0; i <= '~' - ' '; i++)
+			fprintf(fp, "%d%c", dc->font.xft_advance[i], (i < '~' - ' ') ? ' ' : '\n');
+		fprintf(fp, "%s\n%ld\n%s\n", (char *)file, mtime((char *)file), (char *)match);
+	}
+	ok = !ferror(fp);
+	if(fclose(fp) == EOF || !ok || rename(tmp, path) == -1)
+		unlink(tmp);
+	free(match);
+}
+
 int
 textw(DC *dc, const char *text) {
 	return textnw(dc, text, strlen(text)) + dc->font.height;
@@ -1,6 +1,9 @@
 /* See LICENSE file for copyright and license details. */
 
 #include <X11/Xft/Xft.h>
+#include <X11/extensions/XShm.h>
+
+typedef struct GlyphImage GlyphImage;
 
 typedef struct {
 	int x, y, w, h;
@@ -9,6 +12,10 @@ typedef struct {
 	GC gc;
 	Pixmap canvas;
 	XftDraw *xftdraw;
+	Bool raster;          /* draw into image on the client, see resizedc() */
+	XImage *image;
+	XShmSegmentInfo shm;  /* shmid is -1 unless image is shared with the server */
+	GlyphImage **glyphs;  /* rasterized glyphs, by font and index */
 	struct {
 		int ascent;
 		int descent;
@@ -16,8 +23,20 @@ typedef struct {
 		int width;
 		XFontSet set;
 		XFontStruct *xfont;
-		XftFont *xft_font;
+		XftFont *xft_font;       /* opened on first use, see xftfont() */
+		char *xft_name;          /* as requested, set if the font is Xft */
+		char *xft_match;         /* the cached match for xft_name, or NULL */
+		int xft_advance['~' - ' ' + 1]; /* of printable ASCII, -1 if missing */
+		Bool xft_hasadvance;
+		FcPattern *xft_pattern;  /* as requested, for opening fallbacks */
+		FcFontSet *xft_set;      /* fallback candidates, sorted when first needed */
+		XftFont **xft_fallback;  /* opened on first use, indexed like xft_set */
+		unsigned char **xft_cover; /* per page of 256 codepoints, the font index
+		                            * plus one of each codepoint, 0 until looked up */
 	} font;
+#ifdef BENCH
+	unsigned long nextents; /* text extent queries, counted for make bench */
+#endif
 } DC;  /* draw context */
 
 typedef struct {
@@ -26,7 +45,13 @@ typedef struct {
 	unsigned long BG;
 } ColorSet;
 
+typedef struct {
+	unsigned int off, len; /* in bytes */
+} Span; /* part of a text drawn highlighted */
+
+void copydc(DC *dc, int x, int y, unsigned int w, unsigned int h, int dx, int dy);
 void drawrect(DC *dc, int x, int y, unsigned int w, unsigned int h, Bool fill, unsigned long color);
+void drawspans(DC *dc, const char *text, const Span *span, int nspan, ColorSet *col, ColorSet *hicol);
 void drawtext(DC *dc, const char *text, ColorSet *col);
 void drawtextn(DC *dc, const char *text, size_t n, ColorSet *col);
 void freecol(DC *dc, ColorSet *col);
@@ -1,5 +1,8 @@
 /* See LICENSE file for copyright and license details. */
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,22 +11,56 @@
 #include <sys/stat.h>
 
 #define FLAG(x)  (flag[(x)-'a'])
+#define SYS(x)   (l->nsys++, (x)) /* counts the system calls made per entry */
+#define NTHREADS 4                  /* directories scanned concurrently */
 
-static void test(const char *, const char *);
+typedef struct {
+	const char *dir;
+	char **v;  /* names; sorted once complete if cached */
+	size_t n, size;
+	char *buf; /* backing storage of names read from a cache file */
+	bool done;
+	unsigned long nentries, nsys;
+} List;
+
+static void add(List *l, char *s);
+static int cmp(const void *a, const void *b);
+static void listdir(List *l);
+static void merge(List *l, size_t n);
+static void output(const char *name);
+static mode_t dtmode(int type);
+static bool readcache(const char *path, const char *key, List *l);
+static void report(void);
+static bool test(int, const char *, const char *, int, List *);
+static void *worker(void *arg);
+static void writecache(const char *path, const char *key, List *l);
 
 static bool match = false;
 static bool flag[26];
 static struct stat old, new;
+static const char *cachedir = NULL;
+static char flags[sizeof flag + 1];
+static List args;
+static List *lists;
+static int nlists = 0, nextlist = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 
 int
 main(int argc, char *argv[]) {
-	struct dirent *d;
 	char buf[BUFSIZ], *p;
-	DIR *dir;
-	int opt;
+	pthread_t tid[NTHREADS];
+	size_t j;
+	int i, n, opt;
 
-	while((opt = getopt(argc, argv, "abcdefghln:o:pqrsuwx")) != -1)
+	while((opt = getopt(argc, argv, "abcdefghln:o:pqrsuwxC:S")) != -1)
 		switch(opt) {
+		case 'C': /* cache directory contents */
+			cachedir = optarg;
+			break;
+		case 'S': /* report system calls per entry */
+			atexit(report);
+			break;
 		case 'n': /* newer than file */
 		case 'o': /* older than file */
 			if(!(FLAG(opt) = !stat(optarg, (opt == 'n' ? &new : &old))))
@@ -33,52 +70,299 @@ main(int argc, char *argv[]) {
 			FLAG(opt) = true;
 			break;
 		case '?': /* error: unknown flag */
-			fprintf(stderr, "usage: %s [-abcdefghlpqrsuwx] [-n file] [-o file] [file...]\n", argv[0]);
+			fprintf(stderr, "usage: %s [-abcdefghlpqrsuwx] [-n file] [-o file] [-C dir] [-S] [file...]\n", argv[0]);
 			exit(2);
 		}
 	if(optind == argc)
 		while(fgets(buf, sizeof buf, stdin)) {
 			if((p = strchr(buf, '\n')))
 				*p = '\0';
-			test(buf, buf);
+			if(test(AT_FDCWD, buf, buf, DT_UNKNOWN, &args))
+				output(buf);
 		}
-	for(; optind < argc; optind++)
-		if(FLAG('l') && (dir = opendir(argv[optind]))) {
-			/* test directory contents */
-			while((d = readdir(dir)))
-				if(snprintf(buf, sizeof buf, "%s/%s", argv[optind], d->d_name) < sizeof buf)
-					test(buf, d->d_name);
-			closedir(dir);
+	if(!FLAG('l')) {
+		for(; optind < argc; optind++)
+			if(test(AT_FDCWD, argv[optind], argv[optind], DT_UNKNOWN, &args))
+				output(argv[optind]);
+		return match ? 0 : 1;
+	}
+	/* cached listings stand in for a scan only while they depend on nothing
+	 * but the directory itself, which rules out -n and -o */
+	if(FLAG('n') || FLAG('o'))
+		cachedir = NULL;
+	if(cachedir) {
+		for(i = 0, p = flags; i < 26; i++)
+			if(flag[i] && i != 'q'-'a')
+				*p++ = 'a' + i;
+		*p = '\0';
+		if(mkdir(cachedir, 0755) == -1 && errno != EEXIST)
+			perror(cachedir);
+	}
+	/* test directory contents, several directories at a time */
+	nlists = argc - optind;
+	if(!(lists = calloc(nlists, sizeof *lists))) {
+		perror("calloc");
+		exit(2);
+	}
+	for(i = 0; i < nlists; i++)
+		lists[i].dir = argv[optind + i];
+	for(n = 0; n < NTHREADS && n < nlists; n++)
+		if((errno = pthread_create(&tid[n], NULL, worker, NULL))) {
+			perror("pthread_create");
+			exit(2);
 		}
+	if(cachedir) {
+		for(i = 0; i < n; i++)
+			pthread_join(tid[i], NULL);
+		merge(lists, nlists);
+		return match ? 0 : 1;
+	}
+	/* print each directory's entries once it is done, in argument order */
+	for(i = 0; i < nlists; i++) {
+		pthread_mutex_lock(&lock);
+		while(!lists[i].done)
+			pthread_cond_wait(&cond, &lock);
+		pthread_mutex_unlock(&lock);
+		for(j = 0; j < lists[i].n; j++) {
+			output(lists[i].v[j]);
+			free(lists[i].v[j]);
+		}
+		lists[i].n = 0;
+	}
+	for(i = 0; i < n; i++)
+		pthread_join(tid[i], NULL);
+	return match ? 0 : 1;
+}
+
+void
+add(List *l, char *s) {
+	if(!s || (l->n == l->size && !(l->v = realloc(l->v, (l->size += 256) * sizeof *l->v)))) {
+		perror("stest");
+		exit(2);
+	}
+	l->v[l->n++] = s;
+}
+
+int
+cmp(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+mode_t
+dtmode(int type) {
+	switch(type) {
+	case DT_BLK:  return S_IFBLK;
+	case DT_CHR:  return S_IFCHR;
+	case DT_DIR:  return S_IFDIR;
+	case DT_FIFO: return S_IFIFO;
+	case DT_REG:  return S_IFREG;
+	case DT_SOCK: return S_IFSOCK;
+	}
+	return 0;
+}
+
+void
+listdir(List *l) {
+	char key[BUFSIZ], path[BUFSIZ], *p;
+	const char *s, *dir = l->dir;
+	struct dirent *d;
+	struct stat st;
+	DIR *dp;
+
+	if(!(dp = opendir(dir)) || fstat(dirfd(dp), &st) == -1) {
+		if(dp)
+			closedir(dp);
+		if(test(AT_FDCWD, dir, dir, DT_UNKNOWN, l))
+			add(l, strdup(dir));
+		return;
+	}
+	if(!cachedir) {
+		while((d = readdir(dp)))
+			if(test(dirfd(dp), d->d_name, d->d_name, d->d_type, l))
+				add(l, strdup(d->d_name));
+		closedir(dp);
+		return;
+	}
+	/* a listing is valid for as long as the directory is not replaced or
+	 * modified, and only for the tests it was made with */
+	snprintf(key, sizeof key, "%s %lu %lu %ld %ld\n", flags, (unsigned long)st.st_dev,
+	         (unsigned long)st.st_ino, (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+	/* one cache file per directory, named by its %-escaped path */
+	p = path + snprintf(path, sizeof path, "%s/", cachedir);
+	for(s = dir; *s && p < path + sizeof path - 4; s++)
+		if(*s == '/' || *s == '%')
+			p += sprintf(p, "%%%02X", (unsigned char)*s);
 		else
-			test(argv[optind], argv[optind]);
+			*p++ = *s;
+	*p = '\0';
+	if(*s == '\0' && readcache(path, key, l)) {
+		closedir(dp);
+		return;
+	}
+	while((d = readdir(dp)))
+		if(test(dirfd(dp), d->d_name, d->d_name, d->d_type, l))
+			add(l, strdup(d->d_name));
+	closedir(dp);
+	qsort(l->v, l->n, sizeof *l->v, cmp);
+	if(*s == '\0')
+		writecache(path, key, l);
+}
 
-	return match ? 0 : 1;
+void
+merge(List *l, size_t n) {
+	size_t i, min, *pos;
+	const char *s, *last = NULL;
+
+	if(FLAG('q')) {
+		for(i = 0; i < n; i++)
+			if(l[i].n)
+				exit(0);
+		return;
+	}
+	if(!(pos = calloc(n, sizeof *pos))) {
+		perror("calloc");
+		exit(2);
+	}
+	/* each list is sorted, so repeatedly taking the least head yields the
+	 * sorted union; duplicates are then adjacent */
+	for(;;) {
+		for(min = n, i = 0; i < n; i++)
+			if(pos[i] < l[i].n && (min == n || strcmp(l[i].v[pos[i]], l[min].v[pos[min]]) < 0))
+				min = i;
+		if(min == n)
+			break;
+		s = l[min].v[pos[min]++];
+		if(!last || strcmp(s, last))
+			output(s);
+		last = s;
+	}
+	free(pos);
 }
 
 void
-test(const char *path, const char *name) {
+output(const char *name) {
+	if(FLAG('q'))
+		exit(0);
+	match = true;
+	puts(name);
+}
+
+bool
+readcache(const char *path, const char *key, List *l) {
+	FILE *fp;
+	struct stat st;
+	size_t len = strlen(key);
+	char *p, *q;
+
+	if(!(fp = fopen(path, "r")))
+		return false;
+	if(fstat(fileno(fp), &st) == -1 || (size_t)st.st_size < len
+	|| !(l->buf = malloc(st.st_size + 1))
+	|| fread(l->buf, 1, st.st_size, fp) != (size_t)st.st_size
+	|| strncmp(l->buf, key, len)) {
+		fclose(fp);
+		free(l->buf);
+		l->buf = NULL;
+		return false;
+	}
+	fclose(fp);
+	l->buf[st.st_size] = '\0';
+	for(p = l->buf + len; (q = strchr(p, '\n')); p = q + 1) {
+		*q = '\0';
+		add(l, p);
+	}
+	return true;
+}
+
+void
+report(void) {
+	unsigned long nentries = args.nentries, nsys = args.nsys;
+	int i;
+
+	for(i = 0; i < nlists; i++) {
+		nentries += lists[i].nentries;
+		nsys += lists[i].nsys;
+	}
+	fprintf(stderr, "stest: %lu entries, %lu system calls, %.2f per entry\n",
+	        nentries, nsys, nentries ? (double)nsys / nentries : 0);
+}
+
+bool
+test(int fd, const char *path, const char *name, int type, List *l) {
 	struct stat st, ln;
+	bool statted;
 
-	if(!stat(path, &st) && (FLAG('a') || name[0] != '.')          /* hidden files      */
+	/* path is relative to fd; type is the entry's d_type, if known.  One
+	 * stat is shared by all tests, and skipped when d_type already tells
+	 * whether the entry exists, which is all -e asks, and what it is */
+	l->nentries++;
+	statted = type == DT_UNKNOWN || type == DT_LNK
+	       || FLAG('g') || FLAG('n') || FLAG('o') || FLAG('s') || FLAG('u');
+	if(statted ? SYS(fstatat(fd, path, &st, 0)) != 0 : !(st.st_mode = dtmode(type)))
+		return false;
+	return (FLAG('a') || name[0] != '.')                          /* hidden files      */
 	&& (!FLAG('b') || S_ISBLK(st.st_mode))                        /* block special     */
 	&& (!FLAG('c') || S_ISCHR(st.st_mode))                        /* character special */
 	&& (!FLAG('d') || S_ISDIR(st.st_mode))                        /* directory         */
-	&& (!FLAG('e') || access(path, F_OK) == 0)                    /* exists            */
 	&& (!FLAG('f') || S_ISREG(st.st_mode))                        /* regular file      */
 	&& (!FLAG('g') || st.st_mode & S_ISGID)                       /* set-group-id flag */
-	&& (!FLAG('h') || (!lstat(path, &ln) && S_ISLNK(ln.st_mode))) /* symbolic link     */
+	&& (!FLAG('h') || (type == DT_UNKNOWN                         /* symbolic link     */
+	    ? !SYS(fstatat(fd, path, &ln, AT_SYMLINK_NOFOLLOW)) && S_ISLNK(ln.st_mode)
+	    : type == DT_LNK))
 	&& (!FLAG('n') || st.st_mtime > new.st_mtime)                 /* newer than file   */
 	&& (!FLAG('o') || st.st_mtime < old.st_mtime)                 /* older than file   */
 	&& (!FLAG('p') || S_ISFIFO(st.st_mode))                       /* named pipe        */
-	&& (!FLAG('r') || access(path, R_OK) == 0)                    /* readable          */
 	&& (!FLAG('s') || st.st_size > 0)                             /* not empty         */
 	&& (!FLAG('u') || st.st_mode & S_ISUID)                       /* set-user-id flag  */
-	&& (!FLAG('w') || access(path, W_OK) == 0)                    /* writable          */
-	&& (!FLAG('x') || access(path, X_OK) == 0)) {                 /* executable        */
-		if(FLAG('q'))
+	&& (!FLAG('r') || !SYS(faccessat(fd, path, R_OK, 0)))         /* readable          */
+	&& (!FLAG('w') || !SYS(faccessat(fd, path, W_OK, 0)))         /* writable          */
+	&& (!FLAG('x') || ((!statted || S_ISDIR(st.st_mode)           /* executable        */
+	    || st.st_mode & (S_IXUSR|S_IXGRP|S_IXOTH)) && !SYS(faccessat(fd, path, X_OK, 0))));
+}
+
+void *
+worker(void *arg) {
+	int i;
+
+	for(;;) {
+		pthread_mutex_lock(&lock);
+		i = nextlist++;
+		pthread_mutex_unlock(&lock);
+		if(i >= nlists)
+			return NULL;
+		listdir(&lists[i]);
+		if(FLAG('q') && lists[i].n)
 			exit(0);
-		match = true;
-		puts(name);
+		pthread_mutex_lock(&lock);
+		lists[i].done = true;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+void
+writecache(const char *path, const char *key, List *l) {
+	char tmp[BUFSIZ];
+	size_t i;
+	int fd;
+	bool ok;
+	FILE *fp;
+
+	/* the cache only saves work, so failing to write it is not an error */
+	if((size_t)snprintf(tmp, sizeof tmp, "%s.XXXXXX", path) >= sizeof tmp
+	|| (fd = mkstemp(tmp)) == -1)
+		return;
+	if(!(fp = fdopen(fd, "w"))) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	fputs(key, fp);
+	for(i = 0; i < l->n; i++) {
+		fputs(l->v[i], fp);
+		fputc('\n', fp);
 	}
+	ok = !ferror(fp);
+	if(fclose(fp) == EOF || !ok || rename(tmp, path) == -1)
+		unlink(tmp);
 }